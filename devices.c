@@ -0,0 +1,99 @@
+#include "devices.h"
+
+#include "protocol.h"
+
+/* STM32F2xx and STM32F405/407/415/417 */
+static const SectorRun F2_SECTORS[] = {
+    { 4, 16 * 1024 },
+    { 1, 64 * 1024 },
+    { 7, 128 * 1024 },
+    { 0, 0 }
+};
+
+/* STM32F76x/77x in single bank mode */
+static const SectorRun F7_SECTORS[] = {
+    { 4, 32 * 1024 },
+    { 1, 128 * 1024 },
+    { 7, 256 * 1024 },
+    { 0, 0 }
+};
+
+static const DeviceInfo DEVICES[] = {
+    { ID_LOW_DENSITY, 0x08000000, 0x08008000, 4, 1024, NULL, 0xFF },
+    { ID_MED_DENSITY, 0x08000000, 0x08020000, 4, 1024, NULL, 0xFF },
+    { ID_HI_DENSITY, 0x08000000, 0x08080000, 2, 2048, NULL, 0xFF },
+    { ID_CONNECTIVITY, 0x08000000, 0x08040000, 2, 2048, NULL, 0xFF },
+    { ID_MED_DENSITY_VALUE, 0x08000000, 0x08020000, 4, 1024, NULL, 0xFF },
+    { ID_HI_DENSITY_VALUE, 0x08000000, 0x08080000, 2, 2048, NULL, 0xFF },
+    { ID_XL_DENSITY, 0x08000000, 0x08100000, 2, 2048, NULL, 0xFF },
+    /* STM32L1 flash erases to zeroes. */
+    { ID_MED_DENSITY_ULTRA_LOW_POWER, 0x08000000, 0x08060000, 16, 256, NULL,
+            0x00 },
+    { ID_HI_DENSITY_ULTRA_LOW_POWER, 0x08000000, 0x08020000, 16, 256, NULL,
+            0x00 },
+    /* STM32F303x4(6/8)/334xx/328xx */
+    { 0x438, 0x08000000, 0x08010000, 1, 2048, NULL, 0xFF },
+    /* STM32F051 */
+    { 0x440, 0x08000000, 0x08010000, 4, 1024, NULL, 0xFF },
+    /* STM32F205
+     * There are no pages at all in STM32F205.  Reference manual defines a
+     * sector as a smallest erasable unit, so sectors work like "pages". */
+    { 0x411, 0x08000000, 0x08100000, 1, 16384, F2_SECTORS, 0xFF },
+    /* STM32F405/407/415/417 */
+    { 0x413, 0x08000000, 0x08100000, 1, 16384, F2_SECTORS, 0xFF },
+    /* STM32F765
+     * The flash works differently in "single bank" or "dual bank" modes. No
+     * idea which the bootloader uses, assuming single bank. */
+    { 0x451, 0x08000000, 0x08200000, 1, 32768, F7_SECTORS, 0xFF },
+    /* STM32H743
+     * There are no pages at all in STM32H743.  Sectors are all the same
+     * size! Hooray! */
+    { 0x450, 0x08000000, 0x08200000, 1, 128 * 1024, NULL, 0xFF }
+};
+
+const DeviceInfo *stmFindDevice(uint16_t id) {
+    for(size_t i = 0; i < sizeof(DEVICES) / sizeof(DEVICES[0]); ++i) {
+        if(DEVICES[i].id == id) return &DEVICES[i];
+    }
+    return NULL;
+}
+
+size_t stmDevicePageCount(const DeviceInfo *device) {
+    if(!device->sectors) {
+        return (device->flashEndAddr - device->flashBeginAddr) /
+                device->flashPageSize;
+    }
+
+    size_t count = 0;
+    for(const SectorRun *run = device->sectors; run->count; ++run) {
+        count += run->count;
+    }
+    return count;
+}
+
+size_t stmDevicePageIndex(const DeviceInfo *device, uint32_t addr) {
+    size_t offset = addr - device->flashBeginAddr;
+    if(!device->sectors) return offset / device->flashPageSize;
+
+    size_t page = 0;
+    for(const SectorRun *run = device->sectors; run->count; ++run) {
+        if(offset < run->count * run->size) return page + offset / run->size;
+        offset -= run->count * run->size;
+        page += run->count;
+    }
+    return page;
+}
+
+uint32_t stmDevicePageAddr(const DeviceInfo *device, size_t page) {
+    if(!device->sectors) {
+        return device->flashBeginAddr + page * device->flashPageSize;
+    }
+
+    uint32_t addr = device->flashBeginAddr;
+    for(const SectorRun *run = device->sectors; run->count; ++run) {
+        if(page < run->count) return addr + page * run->size;
+        addr += run->count * run->size;
+        page -= run->count;
+    }
+    return addr;
+}
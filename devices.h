@@ -0,0 +1,74 @@
+#ifndef STM32SPROG_DEVICES_H
+#define STM32SPROG_DEVICES_H
+/** \file devices.h
+ *
+ * Flash layout of the supported STM32 devices.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** A run of equally sized erase units. */
+typedef struct {
+    /** The number of units in the run, or 0 to end a list of runs. */
+    unsigned count;
+    /** The size of each unit in bytes. */
+    size_t size;
+} SectorRun;
+
+/** Flash layout of one device family. */
+typedef struct {
+    /** The product ID returned by the GET_ID command. */
+    uint16_t id;
+    /** The first address of the main flash memory. */
+    uint32_t flashBeginAddr;
+    /** One past the last address of the main flash memory. */
+    uint32_t flashEndAddr;
+    /** The number of pages per write protection sector. */
+    int flashPagesPerSector;
+    /** The size of the smallest erasable unit in bytes. */
+    size_t flashPageSize;
+    /** The erase units from the start of flash, for devices whose sectors
+     * differ in size, or NULL if all units are flashPageSize bytes. */
+    const SectorRun *sectors;
+    /** The value of every byte of an erased page: 0xFF on most families,
+     * 0x00 on the STM32L1. */
+    uint8_t erasedValue;
+} DeviceInfo;
+
+/** \brief Look up the flash layout of a device.
+ *
+ * \param id The product ID returned by the GET_ID command.
+ *
+ * \return The device's flash layout, or NULL if the device is unknown.
+ */
+const DeviceInfo *stmFindDevice(uint16_t id);
+
+/** \brief Get the number of erase units of a device.
+ *
+ * \param device The device's flash layout.
+ *
+ * \return The number of pages or sectors in the main flash memory.
+ */
+size_t stmDevicePageCount(const DeviceInfo *device);
+
+/** \brief Find the erase unit containing an address.
+ *
+ * \param device The device's flash layout.
+ * \param addr An address in the main flash memory.
+ *
+ * \return The number of the page or sector containing \a addr.
+ */
+size_t stmDevicePageIndex(const DeviceInfo *device, uint32_t addr);
+
+/** \brief Get the start address of an erase unit.
+ *
+ * \param device The device's flash layout.
+ * \param page A page or sector number.  The number of units is accepted,
+ *             and yields the end address of the flash memory.
+ *
+ * \return The first address of the page or sector.
+ */
+uint32_t stmDevicePageAddr(const DeviceInfo *device, size_t page);
+
+#endif /* STM32SPROG_DEVICES_H */
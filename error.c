@@ -0,0 +1,24 @@
+#include "error.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+/** The last failure in each thread. */
+static __thread StmError lastError = STM_ERROR_NONE;
+static __thread char lastMessage[STM_ERROR_MESSAGE_SIZE];
+
+StmError stmLastError(void) {
+    return lastError;
+}
+
+const char *stmLastErrorMessage(void) {
+    return lastMessage;
+}
+
+void stmSetError(StmError error, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(lastMessage, sizeof(lastMessage), format, args);
+    va_end(args);
+    lastError = error;
+}
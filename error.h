@@ -0,0 +1,63 @@
+#ifndef STM32SPROG_ERROR_H
+#define STM32SPROG_ERROR_H
+/** \file error.h
+ *
+ * Why a function of the library failed.  The library prints nothing; it
+ * records the cause of each failure for the caller to report.  Functions
+ * that work on a \ref StmSession record it in the session, see
+ * stmGetError().  The others record it per thread, see stmLastError().
+ */
+
+/** Causes of failure. */
+typedef enum {
+    /** Nothing has failed. */
+    STM_ERROR_NONE,
+    /** A system call failed, or memory ran out. */
+    STM_ERROR_IO,
+    /** The device did not answer in time. */
+    STM_ERROR_TIMEOUT,
+    /** The device rejected a command. */
+    STM_ERROR_NACK,
+    /** The device, or a replayed log, answered something unexpected. */
+    STM_ERROR_PROTOCOL,
+    /** The device, link or file needs something the library lacks. */
+    STM_ERROR_UNSUPPORTED,
+    /** A file or a device name is malformed. */
+    STM_ERROR_FORMAT,
+    /** An address or a size is beyond what the device has. */
+    STM_ERROR_RANGE,
+    /** Flash does not hold the data written to it. */
+    STM_ERROR_VERIFY
+} StmError;
+
+/** Size of the buffer holding an error message, including the terminator.
+ * Longer messages are truncated. */
+#define STM_ERROR_MESSAGE_SIZE 160
+
+/** \brief Get the cause of the last failure in the calling thread.
+ *
+ * Only meaningful right after a function outside stm32.h failed.
+ *
+ * \return The cause.
+ */
+StmError stmLastError(void);
+
+/** \brief Describe the last failure in the calling thread.
+ *
+ * \return A message such as "unable to open \"/dev/ttyUSB0\"", without a
+ *         trailing period.  It stays valid until the next failure in the
+ *         calling thread.
+ */
+const char *stmLastErrorMessage(void);
+
+/** \brief Record the cause of a failure in the calling thread.
+ *
+ * For the library's own use; it is not exported from the shared library.
+ *
+ * \param error The cause.
+ * \param format A printf() format for the message.
+ */
+void stmSetError(StmError error, const char *format, ...)
+        __attribute__((format(printf, 2, 3)));
+
+#endif /* STM32SPROG_ERROR_H */
@@ -1,49 +1,455 @@
+#define _GNU_SOURCE
+
 #include "firmware.h"
 
+#include <ctype.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-SparseBuffer *readFirmware(const char *fileName, FirmwareFormat *format) {
-    if(format && *format != AUTO && *format != RAW) {
-        return NULL;
-    }
+#include "hex.h"
+
+/** Size of the staging buffer used to merge consecutive records. */
+#define CHUNK_SIZE 4096
+
+/** Longest text record: an Intel HEX record with a colon, 4 header bytes,
+ * 255 data bytes and checksum, plus line ending and terminator.  S-records
+ * are at most 2 + 2 * 256 characters. */
+#define MAX_LINE_LENGTH (1 + 2 * (5 + 255) + 4)
+
+/** The contents of a firmware file. */
+typedef struct {
+    int fd;
+    /** The file's size and modification time when it was opened. */
+    struct stat st;
+    uint8_t *data;
+    size_t length;
+    /** Whether data maps the file, rather than being read into the heap. */
+    bool mapped;
+} FileData;
+
+/** Collects consecutive records into larger blocks before they are stored in
+ * a SparseBuffer. */
+typedef struct {
+    SparseBuffer *buffer;
+    size_t offset;
+    size_t length;
+    uint8_t data[CHUNK_SIZE];
+} Chunk;
+
+static bool loadFile(const char *fileName, bool map, FileData *file);
+static bool fileUnchanged(const FileData *file);
+static void unloadFile(FileData *file);
+
+static FirmwareFormat detectFormat(const FileData *file);
+static bool readRaw(const FileData *file, SparseBuffer *buffer);
+static bool readIntelHex(FILE *file, SparseBuffer *buffer);
+static bool readSRecord(FILE *file, SparseBuffer *buffer);
+static bool readElf(const FileData *file, SparseBuffer *buffer);
+
+static void Chunk_init(Chunk *self, SparseBuffer *buffer);
+static void Chunk_add(Chunk *self, size_t offset, const uint8_t *data,
+        size_t length);
+static void Chunk_flush(Chunk *self);
+
+static size_t trimLine(char *line);
+
+SparseBuffer *stmReadFirmware(const char *fileName, FirmwareFormat *format,
+        FirmwareStorage storage, FirmwareId *id) {
+    FirmwareFormat fileFormat = format ? *format : FIRMWARE_AUTO;
 
     SparseBuffer *buffer = SparseBuffer_create();
-    if(!buffer) goto BufferError;
+    if(!buffer) abort();
 
-    FILE *firmware = fopen(fileName, "rb");
-    if(!firmware) goto OpenError;
+    FileData file;
+    if(!loadFile(fileName, storage == FIRMWARE_MAP, &file)) goto OpenError;
 
-    (void)fseek(firmware, 0L, SEEK_END);
-    size_t length = ftell(firmware);
-    uint8_t *mem = malloc(length);
-    if(!mem) goto AllocError;
+    if(fileFormat == FIRMWARE_AUTO) fileFormat = detectFormat(&file);
 
-    rewind(firmware);
-    if(fread(mem, 1, length, firmware) < length) {
-        goto ReadError;
+    /* Text is parsed from the same bytes as everything else, so that the
+     * identity reported matches the data. */
+    FILE *text = NULL;
+    if((fileFormat == FIRMWARE_IHEX || fileFormat == FIRMWARE_SREC)
+            && file.length > 0) {
+        text = fmemopen(file.data, file.length, "r");
+        if(!text) {
+            stmSetError(STM_ERROR_IO, "fmemopen failed: %s",
+                    strerror(errno));
+            goto ReadError;
+        }
     }
 
-    MemBlock block;
-    block.offset = 0;
-    block.length = length;
-    block.data = mem;
-    SparseBuffer_set(buffer, block);
+    bool ok;
+    switch(fileFormat) {
+    case FIRMWARE_RAW:  ok = readRaw(&file, buffer);              break;
+    case FIRMWARE_IHEX: ok = !text || readIntelHex(text, buffer); break;
+    case FIRMWARE_SREC: ok = !text || readSRecord(text, buffer);  break;
+    case FIRMWARE_ELF:  ok = readElf(&file, buffer);              break;
+    default:
+        stmSetError(STM_ERROR_UNSUPPORTED, "unknown format %d", fileFormat);
+        ok = false;
+        break;
+    }
+    if(text) fclose(text);
+    if(!ok) goto ReadError;
 
-    free(mem);
-    fclose(firmware);
+    if(!fileUnchanged(&file)) {
+        stmSetError(STM_ERROR_IO, "\"%s\" changed while it was read",
+                fileName);
+        goto ReadError;
+    }
 
-    if(format) *format = RAW;
+    if(id) {
+        Sha256 sha;
+        Sha256_init(&sha);
+        Sha256_update(&sha, file.data, file.length);
+        Sha256_final(&sha, id->digest);
+        id->size = file.length;
+    }
+    /* Blocks borrowed from a mapping keep it alive. */
+    if(file.mapped
+            && (fileFormat == FIRMWARE_RAW || fileFormat == FIRMWARE_ELF)) {
+        SparseBuffer_addMapping(buffer, file.data, file.length);
+        file.data = NULL;
+    }
+    unloadFile(&file);
+
+    if(format) *format = fileFormat;
     return buffer;
 
 ReadError:
-    free(mem);
-AllocError:
-    fclose(firmware);
+    unloadFile(&file);
 OpenError:
     SparseBuffer_destroy(buffer);
-BufferError:
     return NULL;
 }
 
+bool stmIdentifyFirmware(const char *fileName, FirmwareId *id) {
+    FILE *firmware = fopen(fileName, "rb");
+    if(!firmware) {
+        stmSetError(STM_ERROR_IO, "unable to open \"%s\": %s", fileName,
+                strerror(errno));
+        return false;
+    }
+
+    Sha256 sha;
+    Sha256_init(&sha);
+    uint64_t size = 0;
+    uint8_t buffer[CHUNK_SIZE];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), firmware)) > 0) {
+        Sha256_update(&sha, buffer, n);
+        size += n;
+    }
+    bool ok = !ferror(firmware);
+    if(!ok) stmSetError(STM_ERROR_IO, "read failed: %s", strerror(errno));
+    fclose(firmware);
+
+    Sha256_final(&sha, id->digest);
+    id->size = size;
+    return ok;
+}
+
+static bool loadFile(const char *fileName, bool map, FileData *file) {
+    file->data = NULL;
+    file->length = 0;
+    file->mapped = false;
+    file->fd = open(fileName, O_RDONLY | O_CLOEXEC);
+    if(file->fd == -1) {
+        stmSetError(STM_ERROR_IO, "unable to open \"%s\": %s", fileName,
+                strerror(errno));
+        return false;
+    }
+    if(fstat(file->fd, &file->st) == -1) goto Error;
+
+    if(map && S_ISREG(file->st.st_mode) && file->st.st_size > 0) {
+        void *data = mmap(NULL, file->st.st_size, PROT_READ, MAP_PRIVATE,
+                file->fd, 0);
+        if(data != MAP_FAILED) {
+            file->data = data;
+            file->length = file->st.st_size;
+            file->mapped = true;
+            return true;
+        }
+    }
+
+    /* Read anything else, which need not be a regular file, to its end. */
+    size_t capacity = S_ISREG(file->st.st_mode) && file->st.st_size > 0 ?
+            (size_t)file->st.st_size : CHUNK_SIZE;
+    for(;;) {
+        if(file->length == capacity || !file->data) {
+            if(file->data) capacity *= 2;
+            uint8_t *data = realloc(file->data, capacity);
+            if(!data) abort();
+            file->data = data;
+        }
+        ssize_t n = read(file->fd, file->data + file->length,
+                capacity - file->length);
+        if(n == 0) break;
+        if(n == -1) {
+            if(errno == EINTR) continue;
+            goto Error;
+        }
+        file->length += n;
+    }
+    return true;
+
+Error:
+    stmSetError(STM_ERROR_IO, "read failed: %s", strerror(errno));
+    unloadFile(file);
+    return false;
+}
+
+static bool fileUnchanged(const FileData *file) {
+    if(!S_ISREG(file->st.st_mode)) return true;
+    struct stat st;
+    return fstat(file->fd, &st) == 0 && st.st_size == file->st.st_size
+            && st.st_mtim.tv_sec == file->st.st_mtim.tv_sec
+            && st.st_mtim.tv_nsec == file->st.st_mtim.tv_nsec;
+}
+
+static void unloadFile(FileData *file) {
+    if(file->mapped) {
+        if(file->data) munmap(file->data, file->length);
+    } else {
+        free(file->data);
+    }
+    if(file->fd != -1) close(file->fd);
+}
+
+static FirmwareFormat detectFormat(const FileData *file) {
+    /* A raw image starts with the initial stack pointer, which is word
+     * aligned and so can never begin with one of these characters. */
+    const uint8_t *magic = file->data;
+    if(file->length >= SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0) {
+        return FIRMWARE_ELF;
+    }
+    if(file->length > 0 && magic[0] == ':') return FIRMWARE_IHEX;
+    if(file->length > 0 && magic[0] == 'S') return FIRMWARE_SREC;
+    return FIRMWARE_RAW;
+}
+
+static bool readRaw(const FileData *file, SparseBuffer *buffer) {
+    if(file->length == 0) return true;
+
+    MemBlock block;
+    block.offset = 0;
+    block.length = file->length;
+    block.data = file->data;
+    /* Mapped files are used in place. */
+    if(file->mapped) {
+        SparseBuffer_borrow(buffer, block);
+    } else {
+        SparseBuffer_set(buffer, block);
+    }
+    return true;
+}
+
+static bool readIntelHex(FILE *file, SparseBuffer *buffer) {
+    char line[MAX_LINE_LENGTH];
+    uint8_t record[5 + 255];
+    size_t base = 0;
+    int lineNum = 0;
+    bool eof = false;
+    Chunk chunk;
+
+    Chunk_init(&chunk, buffer);
+    while(!eof && fgets(line, sizeof(line), file)) {
+        lineNum++;
+
+        size_t len = trimLine(line);
+        if(len == 0) continue;
+        if(line[0] != ':' || len % 2 == 0 || len < 11) goto FormatError;
+
+        size_t count = (len - 1) / 2;
+        if(count > sizeof(record)) goto FormatError;
+        if(!decodeHex(line + 1, count, record)) goto FormatError;
+        uint8_t checksum = 0;
+        for(size_t i = 0; i < count; ++i) checksum += record[i];
+        if(checksum != 0) {
+            stmSetError(STM_ERROR_FORMAT, "checksum error on line %d", lineNum);
+            return false;
+        }
+
+        size_t dataLen = record[0];
+        if(count != dataLen + 5) goto FormatError;
+        size_t addr = (record[1] << 8) | record[2];
+        const uint8_t *data = record + 4;
+
+        switch(record[3]) {
+        case 0x00: /* Data */
+            Chunk_add(&chunk, base + addr, data, dataLen);
+            break;
+        case 0x01: /* End of file */
+            eof = true;
+            break;
+        case 0x02: /* Extended segment address */
+            if(dataLen != 2) goto FormatError;
+            base = ((data[0] << 8) | data[1]) << 4;
+            break;
+        case 0x04: /* Extended linear address */
+            if(dataLen != 2) goto FormatError;
+            base = (size_t)((data[0] << 8) | data[1]) << 16;
+            break;
+        case 0x03: /* Start segment address */
+        case 0x05: /* Start linear address */
+            break;
+        default:
+            goto FormatError;
+        }
+    }
+    Chunk_flush(&chunk);
+
+    return true;
+
+FormatError:
+    stmSetError(STM_ERROR_FORMAT, "invalid Intel HEX record on line %d",
+            lineNum);
+    return false;
+}
+
+static bool readSRecord(FILE *file, SparseBuffer *buffer) {
+    char line[MAX_LINE_LENGTH];
+    uint8_t record[1 + 255];
+    int lineNum = 0;
+    bool eof = false;
+    Chunk chunk;
+
+    Chunk_init(&chunk, buffer);
+    while(!eof && fgets(line, sizeof(line), file)) {
+        lineNum++;
+
+        size_t len = trimLine(line);
+        if(len == 0) continue;
+        if(line[0] != 'S' || len % 2 || len < 4) goto FormatError;
+
+        size_t count = (len - 2) / 2;
+        if(count > sizeof(record)) goto FormatError;
+        if(!decodeHex(line + 2, count, record)) goto FormatError;
+        if(record[0] != count - 1) goto FormatError;
+        uint8_t checksum = 0;
+        for(size_t i = 0; i < count; ++i) checksum += record[i];
+        if(checksum != 0xFF) {
+            stmSetError(STM_ERROR_FORMAT, "checksum error on line %d", lineNum);
+            return false;
+        }
+
+        size_t addrLen;
+        switch(line[1]) {
+        case '0': /* Header */
+        case '5': /* 16-bit record count */
+        case '6': /* 24-bit record count */
+            continue;
+        case '1': addrLen = 2; break;
+        case '2': addrLen = 3; break;
+        case '3': addrLen = 4; break;
+        case '7': /* 32-bit start address */
+        case '8': /* 24-bit start address */
+        case '9': /* 16-bit start address */
+            eof = true;
+            continue;
+        default:
+            goto FormatError;
+        }
+
+        /* Count byte, address and checksum surround the data. */
+        if(count < 1 + addrLen + 1) goto FormatError;
+        size_t addr = 0;
+        for(size_t i = 0; i < addrLen; ++i) addr = (addr << 8) | record[1 + i];
+        Chunk_add(&chunk, addr, record + 1 + addrLen, count - addrLen - 2);
+    }
+    Chunk_flush(&chunk);
+
+    return true;
+
+FormatError:
+    stmSetError(STM_ERROR_FORMAT, "invalid S-record on line %d", lineNum);
+    return false;
+}
+
+static bool readElf(const FileData *file, SparseBuffer *buffer) {
+    const uint8_t *mem = file->data;
+    size_t length = file->length;
+    if(length < sizeof(Elf32_Ehdr)) goto FormatError;
+
+    const Elf32_Ehdr *ehdr = (const Elf32_Ehdr *)mem;
+    if(memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+            ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||
+            ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+            ehdr->e_phentsize != sizeof(Elf32_Phdr) ||
+            ehdr->e_phoff > length ||
+            (size_t)ehdr->e_phnum * sizeof(Elf32_Phdr) >
+                    length - ehdr->e_phoff) {
+        goto FormatError;
+    }
+
+    const Elf32_Phdr *phdr = (const Elf32_Phdr *)(mem + ehdr->e_phoff);
+    for(int i = 0; i < ehdr->e_phnum; ++i) {
+        /* Zero-initialized data (p_memsz beyond p_filesz) is set up by the
+         * startup code, not programmed. */
+        if(phdr[i].p_type != PT_LOAD || phdr[i].p_filesz == 0) continue;
+        if(phdr[i].p_offset > length ||
+                phdr[i].p_filesz > length - phdr[i].p_offset) {
+            goto FormatError;
+        }
+
+        MemBlock block;
+        block.offset = phdr[i].p_paddr;
+        block.length = phdr[i].p_filesz;
+        block.data = mem + phdr[i].p_offset;
+        /* Segments of mapped files are used in place. */
+        if(file->mapped) {
+            SparseBuffer_borrow(buffer, block);
+        } else {
+            SparseBuffer_set(buffer, block);
+        }
+    }
+
+    return true;
+
+FormatError:
+    stmSetError(STM_ERROR_FORMAT, "invalid or unsupported ELF file");
+    return false;
+}
+
+static void Chunk_init(Chunk *self, SparseBuffer *buffer) {
+    self->buffer = buffer;
+    self->offset = 0;
+    self->length = 0;
+}
+
+static void Chunk_add(Chunk *self, size_t offset, const uint8_t *data,
+        size_t length) {
+    if(self->length && (offset != self->offset + self->length ||
+            self->length + length > CHUNK_SIZE)) {
+        Chunk_flush(self);
+    }
+    if(!self->length) self->offset = offset;
+    memcpy(self->data + self->length, data, length);
+    self->length += length;
+}
+
+static void Chunk_flush(Chunk *self) {
+    if(!self->length) return;
+
+    MemBlock block;
+    block.offset = self->offset;
+    block.length = self->length;
+    block.data = self->data;
+    SparseBuffer_set(self->buffer, block);
+    self->length = 0;
+}
+
+static size_t trimLine(char *line) {
+    size_t len = strlen(line);
+    while(len && isspace((unsigned char)line[len - 1])) line[--len] = '\0';
+    return len;
+}
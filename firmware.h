@@ -1,31 +1,78 @@
 #ifndef STM32SPROG_FIRMWARE_H
 #define STM32SPROG_FIRMWARE_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "sha256.h"
 #include "sparse-buffer.h"
 
 typedef enum {
     /** Detect the file type from its contents. */
-    AUTO,
+    FIRMWARE_AUTO,
     /** Raw binary. */
-    RAW,
+    FIRMWARE_RAW,
     /** Intel HEX. */
-    IHEX,
+    FIRMWARE_IHEX,
     /** Motorola S-record. */
-    SREC
+    FIRMWARE_SREC,
+    /** ELF32 executable.  Only the file contents of loadable segments are
+     * read, at their physical addresses. */
+    FIRMWARE_ELF
 } FirmwareFormat;
 
+/** How stmReadFirmware() holds on to the contents of a file. */
+typedef enum {
+    /** Raw and ELF data is used in place from a mapping of the file.  The
+     * file must not be truncated or rewritten in place while the buffer
+     * exists.  Suits callers done with the buffer before the file can
+     * change. */
+    FIRMWARE_MAP,
+    /** The data is read and copied, so the buffer is unaffected by later
+     * changes to the file.  Suits buffers kept indefinitely. */
+    FIRMWARE_COPY
+} FirmwareStorage;
+
+/** Identifies the contents of a firmware file. */
+typedef struct {
+    /** SHA-256 digest of the file contents. */
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    /** The file size in bytes. */
+    uint64_t size;
+} FirmwareId;
+
 /** Read a firmware file into memory.
  *
  * \param[in] fileName The file to read.
  * \param[in,out] format The firmware file format.  If NULL, automatic
- *                       detection will be used.  If AUTO is explicitely
- *                       specified, this will be set to the format detected.
+ *                       detection will be used.  If FIRMWARE_AUTO is
+ *                       explicitely specified, this will be set to the format
+ *                       detected.
+ * \param[in] storage Whether data may be used in place from the file.
+ * \param[out] id If not NULL, set to the identity of the data parsed, which
+ *                differs from an earlier stmIdentifyFirmware() if the file
+ *                has been replaced since.
+ *
+ * Files that change while they are read are rejected.
  *
  * \return A new SparseBuffer containing the firmware data.  The caller is
  *         responsible for destroying it.  Returns NULL if the file could not
- *         be read or did not match the specified format.
+ *         be read or did not match the specified format; stmLastError()
+ *         tells why.
+ */
+SparseBuffer *stmReadFirmware(const char *fileName, FirmwareFormat *format,
+        FirmwareStorage storage, FirmwareId *id);
+
+/** Identify the contents of a firmware file without parsing it.
+ *
+ * \param[in] fileName The file to read.
+ * \param[out] id The identity of the file contents.
+ *
+ * \return \c true on success, \c false if the file could not be read;
+ *         stmLastError() tells why.
  */
-SparseBuffer *readFirmware(const char *fileName, FirmwareFormat *format);
+bool stmIdentifyFirmware(const char *fileName, FirmwareId *id);
 
 #endif /* STM32SPROG_FIRMWARE_H */
 
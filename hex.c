@@ -0,0 +1,20 @@
+#include "hex.h"
+
+static int hexDigit(char c);
+
+bool decodeHex(const char *str, size_t count, uint8_t *out) {
+    for(size_t i = 0; i < count; ++i) {
+        int high = hexDigit(str[2 * i]);
+        int low = hexDigit(str[2 * i + 1]);
+        if(high < 0 || low < 0) return false;
+        out[i] = (high << 4) | low;
+    }
+    return true;
+}
+
+static int hexDigit(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
@@ -0,0 +1,24 @@
+#ifndef STM32SPROG_HEX_H
+#define STM32SPROG_HEX_H
+/** \file hex.h
+ *
+ * Decoding of hexadecimal text, shared by the firmware readers and the
+ * traffic log parser.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** \brief Decode pairs of hexadecimal digits into bytes.
+ *
+ * \param str The digits, two per byte, in either case.
+ * \param count The number of bytes to decode.
+ * \param out Receives the count decoded bytes.
+ *
+ * \return \c false if one of the first 2 * count characters of str is not a
+ *         hexadecimal digit.
+ */
+bool decodeHex(const char *str, size_t count, uint8_t *out);
+
+#endif /* STM32SPROG_HEX_H */
@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+
+#include "image-cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "STM32IMG"
+#define CACHE_VERSION 1
+
+/** Data of each extent starts at a multiple of this many bytes. */
+#define DATA_ALIGNMENT 8
+
+/** Header of a cache file.  It is followed by the page map, the extent table
+ * and the extent data.  Fields are in host byte order; cache files are not
+ * meant to move between machines. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t deviceId;
+    /** Identity of the firmware file, as from stmIdentifyFirmware(). */
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint64_t size;
+    uint32_t format;
+    uint32_t numPages;
+    uint32_t numExtents;
+    /** CRC-32 of the header up to here, the page map and the extent
+     * table. */
+    uint32_t crc;
+} CacheHeader;
+
+/** A contiguous run of image data, in address order. */
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+    /** Position of the data in the file. */
+    uint32_t dataOffset;
+    /** CRC-32 of the data. */
+    uint32_t crc;
+} CacheExtent;
+
+struct ImageCache {
+    char *dirName;
+};
+
+struct CachedImage {
+    void *map;
+    size_t mapSize;
+    SparseBuffer *buffer;
+    const uint8_t *pages;
+    size_t numPages;
+    FirmwareFormat format;
+};
+
+static char *cacheFileName(const ImageCache *self, const FirmwareId *id,
+        uint16_t deviceId);
+static size_t tableOffset(uint32_t numPages);
+static size_t align(size_t offset);
+static bool writeAll(int fd, const void *data, size_t length);
+
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t length);
+static void initCrcTable(void);
+
+static uint32_t crcTable[256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+ImageCache *ImageCache_create(const char *dirName) {
+    /* Cache files are trusted once their CRCs match, so nobody else may
+     * put files in the directory. */
+    if(mkdir(dirName, 0700) == -1 && errno != EEXIST) {
+        stmSetError(STM_ERROR_IO, "unable to create \"%s\": %s", dirName,
+                strerror(errno));
+        return NULL;
+    }
+
+    ImageCache *self = malloc(sizeof(ImageCache));
+    if(!self) abort();
+    self->dirName = strdup(dirName);
+    if(!self->dirName) abort();
+    return self;
+}
+
+void ImageCache_destroy(ImageCache *self) {
+    free(self->dirName);
+    free(self);
+}
+
+CachedImage *ImageCache_load(ImageCache *self, const FirmwareId *id,
+        uint16_t deviceId) {
+    CachedImage *image = NULL;
+    char *fileName = cacheFileName(self, id, deviceId);
+
+    int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        stmSetError(STM_ERROR_IO, "unable to open \"%s\": %s", fileName,
+                strerror(errno));
+        goto OpenError;
+    }
+
+    struct stat info;
+    if(fstat(fd, &info) == -1 || (size_t)info.st_size < sizeof(CacheHeader)) {
+        goto Invalid;
+    }
+    size_t mapSize = info.st_size;
+    void *map = mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) goto Invalid;
+
+    const CacheHeader *header = map;
+    if(memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic))
+            || header->version != CACHE_VERSION
+            || header->deviceId != deviceId
+            || memcmp(header->digest, id->digest, sizeof(header->digest))
+            || header->size != id->size) {
+        goto Unmap;
+    }
+    size_t tableEnd = tableOffset(header->numPages)
+            + (size_t)header->numExtents * sizeof(CacheExtent);
+    if(tableEnd > mapSize) goto Unmap;
+    uint32_t crc = crc32(0, map, offsetof(CacheHeader, crc));
+    crc = crc32(crc, (const uint8_t *)map + sizeof(CacheHeader),
+            tableEnd - sizeof(CacheHeader));
+    if(crc != header->crc) goto Unmap;
+
+    image = malloc(sizeof(CachedImage));
+    if(!image) abort();
+    image->map = map;
+    image->mapSize = mapSize;
+    image->buffer = SparseBuffer_create();
+    image->pages = (const uint8_t *)map + sizeof(CacheHeader);
+    image->numPages = header->numPages;
+    image->format = header->format;
+
+    const CacheExtent *extents = (const CacheExtent *)((const uint8_t *)map
+            + tableOffset(header->numPages));
+    for(uint32_t i = 0; i < header->numExtents; ++i) {
+        const CacheExtent *extent = &extents[i];
+        if((size_t)extent->dataOffset + extent->length > mapSize) {
+            goto Destroy;
+        }
+        MemBlock block = {
+            .offset = extent->offset,
+            .length = extent->length,
+            .data = (const uint8_t *)map + extent->dataOffset
+        };
+        if(crc32(0, block.data, block.length) != extent->crc) goto Destroy;
+        SparseBuffer_borrow(image->buffer, block);
+    }
+
+    close(fd);
+    free(fileName);
+    return image;
+
+Destroy:
+    SparseBuffer_destroy(image->buffer);
+    free(image);
+    image = NULL;
+Unmap:
+    munmap(map, mapSize);
+Invalid:
+    stmSetError(STM_ERROR_FORMAT, "invalid cache file \"%s\"", fileName);
+    close(fd);
+OpenError:
+    free(fileName);
+    return NULL;
+}
+
+bool ImageCache_store(ImageCache *self, const FirmwareId *id,
+        uint16_t deviceId, FirmwareFormat format, const SparseBuffer *buffer,
+        const uint8_t *pages, size_t numPages) {
+    char *fileName = cacheFileName(self, id, deviceId);
+    char *tempName = NULL;
+    CacheExtent *extents = NULL;
+    size_t numExtents = 0;
+    int fd = -1;
+
+    /* Lay out the extents first; the header covers the table. */
+    MemBlock block;
+    SparseBufferCursor cursor;
+    size_t dataOffset = 0;
+    SparseBuffer_begin(buffer, &cursor);
+    while((block = SparseBuffer_next(buffer, &cursor, 0)).data) {
+        if(!block.length) continue;
+        CacheExtent *more = realloc(extents,
+                (numExtents + 1) * sizeof(CacheExtent));
+        if(!more) abort();
+        extents = more;
+        CacheExtent *extent = &extents[numExtents++];
+        extent->offset = block.offset;
+        extent->length = block.length;
+        extent->dataOffset = dataOffset;
+        extent->crc = crc32(0, block.data, block.length);
+        if(extent->offset != block.offset
+                || extent->length != block.length) {
+            goto Error;
+        }
+        dataOffset = align(dataOffset + block.length);
+    }
+
+    size_t dataStart = align(tableOffset(numPages)
+            + numExtents * sizeof(CacheExtent));
+    if(dataStart + dataOffset > UINT32_MAX) goto Error;
+    for(size_t i = 0; i < numExtents; ++i) {
+        extents[i].dataOffset += dataStart;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.deviceId = deviceId;
+    memcpy(header.digest, id->digest, sizeof(header.digest));
+    header.size = id->size;
+    header.format = format;
+    header.numPages = numPages;
+    header.numExtents = numExtents;
+
+    static const uint8_t padding[DATA_ALIGNMENT] = { 0 };
+    size_t pagesPadding = tableOffset(numPages) - sizeof(header) - numPages;
+    size_t tablePadding = dataStart - tableOffset(numPages)
+            - numExtents * sizeof(CacheExtent);
+    header.crc = crc32(0, (const uint8_t *)&header,
+            offsetof(CacheHeader, crc));
+    header.crc = crc32(header.crc, pages, numPages);
+    header.crc = crc32(header.crc, padding, pagesPadding);
+    header.crc = crc32(header.crc, (const uint8_t *)extents,
+            numExtents * sizeof(CacheExtent));
+
+    if(asprintf(&tempName, "%s.XXXXXX", fileName) == -1) abort();
+    fd = mkstemp(tempName);
+    if(fd == -1) goto Error;
+
+    bool ok = writeAll(fd, &header, sizeof(header))
+            && writeAll(fd, pages, numPages)
+            && writeAll(fd, padding, pagesPadding)
+            && writeAll(fd, extents, numExtents * sizeof(CacheExtent))
+            && writeAll(fd, padding, tablePadding);
+    SparseBuffer_begin(buffer, &cursor);
+    while(ok && (block = SparseBuffer_next(buffer, &cursor, 0)).data) {
+        if(!block.length) continue;
+        ok = writeAll(fd, block.data, block.length) && writeAll(fd, padding,
+                align(block.length) - block.length);
+    }
+    if(!ok || fchmod(fd, 0644) == -1 || close(fd) == -1) {
+        fd = -1;
+        goto Error;
+    }
+    fd = -1;
+    if(rename(tempName, fileName) == -1) goto Error;
+
+    free(extents);
+    free(tempName);
+    free(fileName);
+    return true;
+
+Error:
+    stmSetError(STM_ERROR_IO, "unable to write \"%s\"", fileName);
+    if(fd != -1) close(fd);
+    if(tempName) (void)unlink(tempName);
+    free(extents);
+    free(tempName);
+    free(fileName);
+    return false;
+}
+
+void CachedImage_destroy(CachedImage *self) {
+    SparseBuffer_destroy(self->buffer);
+    munmap(self->map, self->mapSize);
+    free(self);
+}
+
+const SparseBuffer *CachedImage_buffer(const CachedImage *self) {
+    return self->buffer;
+}
+
+const uint8_t *CachedImage_pages(const CachedImage *self, size_t *count) {
+    *count = self->numPages;
+    return self->pages;
+}
+
+FirmwareFormat CachedImage_format(const CachedImage *self) {
+    return self->format;
+}
+
+static char *cacheFileName(const ImageCache *self, const FirmwareId *id,
+        uint16_t deviceId) {
+    char digest[2 * SHA256_DIGEST_SIZE + 1];
+    for(size_t i = 0; i < SHA256_DIGEST_SIZE; ++i) {
+        sprintf(digest + 2 * i, "%02x", id->digest[i]);
+    }
+
+    char *fileName;
+    if(asprintf(&fileName, "%s/%s-%" PRIx64 "-%03x.img", self->dirName,
+            digest, id->size, deviceId) == -1) {
+        abort();
+    }
+    return fileName;
+}
+
+/** \brief Get the position of the extent table in a cache file. */
+static size_t tableOffset(uint32_t numPages) {
+    return align(sizeof(CacheHeader) + numPages);
+}
+
+static size_t align(size_t offset) {
+    return (offset + DATA_ALIGNMENT - 1) & ~(size_t)(DATA_ALIGNMENT - 1);
+}
+
+static bool writeAll(int fd, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    while(length > 0) {
+        ssize_t n = write(fd, bytes, length);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        bytes += n;
+        length -= n;
+    }
+    return true;
+}
+
+/** \brief Update a CRC-32 (IEEE 802.3) with more data.
+ *
+ * \param crc The CRC of the preceding data, or 0 to start.
+ * \param data The data.
+ * \param length The size of the data in bytes.
+ *
+ * \return The CRC including \a data.
+ */
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t length) {
+    pthread_once(&crcTableOnce, initCrcTable);
+
+    crc = ~crc;
+    for(size_t i = 0; i < length; ++i) {
+        crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void initCrcTable(void) {
+    for(uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for(int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+        crcTable[i] = crc;
+    }
+}
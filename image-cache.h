@@ -0,0 +1,108 @@
+#ifndef STM32SPROG_IMAGE_CACHE_H
+#define STM32SPROG_IMAGE_CACHE_H
+/** \file image-cache.h
+ *
+ * On-disk cache of firmware images as planned for a device type, so that
+ * each image is parsed and mapped to flash pages only once.  Cache files are
+ * memory-mapped, and their data is used without copying.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "firmware.h"
+#include "sparse-buffer.h"
+
+/** \defgroup ImageCacheType ImageCache
+ * \brief A directory of planned firmware images.
+ * @{
+ */
+
+/** \brief Image cache handle. */
+typedef struct ImageCache ImageCache;
+
+/** \brief An image loaded from an \ref ImageCache. */
+typedef struct CachedImage CachedImage;
+
+/** \brief Image cache constructor.
+ *
+ * \param dirName The cache directory.  It is created if it does not exist.
+ *
+ * \return A new image cache, which must be freed by ImageCache_destroy(), or
+ *         NULL if the directory could not be created.
+ */
+ImageCache *ImageCache_create(const char *dirName);
+
+/** \brief Image cache destructor.  Images loaded from the cache stay valid.
+ *
+ * \param self The image cache.
+ */
+void ImageCache_destroy(ImageCache *self);
+
+/** \brief Load an image planned for a device type.
+ *
+ * \param self The image cache.
+ * \param id The contents of the firmware file.
+ * \param deviceId The product ID of the device type.
+ *
+ * \return The image, which must be freed by CachedImage_destroy(), or NULL if
+ *         the cache does not hold a valid copy of it.
+ */
+CachedImage *ImageCache_load(ImageCache *self, const FirmwareId *id,
+        uint16_t deviceId);
+
+/** \brief Store an image planned for a device type.
+ *
+ * The cache file is replaced atomically, so concurrent readers see either
+ * the old or the new file.
+ *
+ * \param self The image cache.
+ * \param id The contents of the firmware file.
+ * \param deviceId The product ID of the device type.
+ * \param format The format the file was parsed as.
+ * \param buffer The image, at its flash addresses.
+ * \param pages The page map of the image, as from stmMapPages().
+ * \param numPages The number of entries in \a pages.
+ *
+ * \return \c true on success, \c false if the file could not be written.
+ */
+bool ImageCache_store(ImageCache *self, const FirmwareId *id,
+        uint16_t deviceId, FirmwareFormat format, const SparseBuffer *buffer,
+        const uint8_t *pages, size_t numPages);
+
+/** \brief Cached image destructor.  Unmaps the cache file.
+ *
+ * \param self The cached image.
+ */
+void CachedImage_destroy(CachedImage *self);
+
+/** \brief Get the data of a cached image.
+ *
+ * \param self The cached image.
+ *
+ * \return The image, at its flash addresses.  Valid until the cached image is
+ *         destroyed.
+ */
+const SparseBuffer *CachedImage_buffer(const CachedImage *self);
+
+/** \brief Get the page map of a cached image.
+ *
+ * \param self The cached image.
+ * \param[out] count The number of entries in the page map.
+ *
+ * \return The page map.  Valid until the cached image is destroyed.
+ */
+const uint8_t *CachedImage_pages(const CachedImage *self, size_t *count);
+
+/** \brief Get the format a cached image was parsed as.
+ *
+ * \param self The cached image.
+ *
+ * \return The format of the firmware file.
+ */
+FirmwareFormat CachedImage_format(const CachedImage *self);
+
+/*@}*/
+
+#endif /* STM32SPROG_IMAGE_CACHE_H */
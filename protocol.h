@@ -0,0 +1,44 @@
+#ifndef STM32SPROG_PROTOCOL_H
+#define STM32SPROG_PROTOCOL_H
+/** \file protocol.h
+ *
+ * Constants of the STM32 USART bootloader protocol (ST AN3155).
+ */
+
+/** Byte sent by the host to start autobaud detection. */
+#define SYNC_BYTE 0x7F
+
+enum {
+    ACK = 0x79,
+    NACK = 0x1F
+};
+
+typedef enum {
+    CMD_GET_VERSION = 0x00,
+    CMD_GET_READ_STATUS = 0x01,
+    CMD_GET_ID = 0x02,
+    CMD_READ_MEM = 0x11,
+    CMD_GO = 0x21,
+    CMD_WRITE_MEM = 0x31,
+    CMD_ERASE = 0x43,
+    CMD_EXTENDED_ERASE = 0x44,
+    CMD_WRITE_PROTECT = 0x63,
+    CMD_WRITE_UNPROTECT = 0x73,
+    CMD_READ_PROTECT = 0x82,
+    CMD_READ_UNPROTECT = 0x92
+} Command;
+#define NUM_COMMANDS_KNOWN 12
+
+enum {
+    ID_LOW_DENSITY = 0x0412,
+    ID_MED_DENSITY = 0x0410,
+    ID_HI_DENSITY = 0x0414,
+    ID_CONNECTIVITY = 0x0418,
+    ID_MED_DENSITY_VALUE = 0x0420,
+    ID_HI_DENSITY_VALUE = 0x0428,
+    ID_XL_DENSITY = 0x0430,
+    ID_MED_DENSITY_ULTRA_LOW_POWER = 0x0436,
+    ID_HI_DENSITY_ULTRA_LOW_POWER = 0x0416
+};
+
+#endif /* STM32SPROG_PROTOCOL_H */
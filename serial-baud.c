@@ -0,0 +1,41 @@
+#include "serial-baud.h"
+
+#ifdef __linux__
+
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+bool stmSerialArbitraryBaud(void) {
+    return true;
+}
+
+int stmSerialSetBaudRate(int fd, int baud) {
+    struct termios2 opts;
+    if(ioctl(fd, TCGETS2, &opts) == -1) return -1;
+
+    opts.c_cflag &= ~CBAUD;
+    opts.c_cflag |= BOTHER;
+    opts.c_cflag &= ~(CBAUD << IBSHIFT);
+    opts.c_cflag |= BOTHER << IBSHIFT;
+    opts.c_ispeed = baud;
+    opts.c_ospeed = baud;
+    if(ioctl(fd, TCSETS2, &opts) == -1) return -1;
+
+    /* The driver rounds to the rate its divisor can produce. */
+    if(ioctl(fd, TCGETS2, &opts) == -1) return -1;
+    return opts.c_ospeed;
+}
+
+#else
+
+bool stmSerialArbitraryBaud(void) {
+    return false;
+}
+
+int stmSerialSetBaudRate(int fd, int baud) {
+    (void)fd;
+    (void)baud;
+    return -1;
+}
+
+#endif
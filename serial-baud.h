@@ -0,0 +1,27 @@
+#ifndef STM32SPROG_SERIAL_BAUD_H
+#define STM32SPROG_SERIAL_BAUD_H
+/** \file serial-baud.h
+ *
+ * Arbitrary baud rate support.  Kept apart from serial.c because the kernel
+ * termios2 definitions conflict with those of <termios.h>.
+ */
+
+#include <stdbool.h>
+
+/** \brief Check whether arbitrary baud rates can be set on this platform.
+ *
+ * \return \c true if stmSerialSetBaudRate() is available.
+ */
+bool stmSerialArbitraryBaud(void);
+
+/** \brief Set the baud rate of a serial device to any integer rate.
+ *
+ * \param fd A file descriptor of an open serial device.
+ * \param baud The requested baud rate.
+ *
+ * \return The baud rate actually configured by the driver, or -1 if the rate
+ *         could not be set.
+ */
+int stmSerialSetBaudRate(int fd, int baud);
+
+#endif /* STM32SPROG_SERIAL_BAUD_H */
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+
+#include "serial-transport.h"
+#include "simulator.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/** A simulated target served by a thread of this process over a socket
+ * pair.  Nothing leaves the process, so runs are repeatable and need no
+ * pseudo-terminal. */
+typedef struct {
+    SerialDev base;
+    /** The host end of the socket pair. */
+    int fd;
+    /** The simulator end of the socket pair. */
+    int simFd;
+    Simulator *sim;
+    pthread_t thread;
+} LoopbackDev;
+
+static SerialDev *loopbackOpen(const char *options, int baud);
+static void loopbackClose(SerialDev *dev);
+static ssize_t loopbackRead(SerialDev *dev, uint8_t *buffer, size_t n,
+        uint64_t deadline);
+static ssize_t loopbackWrite(SerialDev *dev, const uint8_t *buffer, size_t n,
+        uint64_t deadline);
+static bool loopbackFlush(SerialDev *dev);
+static SerialLatency loopbackSetLowLatency(SerialDev *dev);
+static bool loopbackSetDtr(SerialDev *dev, bool dtr);
+
+/** \brief Parse simulator options.
+ *
+ * \param options Comma separated options named after the stm32sim flags:
+ *                i=ID, b=BAUD, E=USEC, W=USEC, t=USEC, f=N, p=SIZE, s=SIZE
+ *                and x.
+ * \param config The parameters to update.
+ *
+ * \return \c true on success, \c false if an option is unknown.
+ */
+static bool parseOptions(const char *options, SimConfig *config);
+
+static void *runSimulator(void *arg);
+
+const SerialTransport STM_LOOPBACK_TRANSPORT = {
+    .prefix = "sim:",
+    .open = loopbackOpen,
+    .close = loopbackClose,
+    .read = loopbackRead,
+    .write = loopbackWrite,
+    .flush = loopbackFlush,
+    .setLowLatency = loopbackSetLowLatency,
+    .setDtr = loopbackSetDtr
+};
+
+static SerialDev *loopbackOpen(const char *options, int baud) {
+    SimConfig config;
+    Simulator_defaultConfig(&config);
+    if(!parseOptions(options, &config)) {
+        stmSetError(STM_ERROR_FORMAT, "invalid simulator options \"%s\"",
+                options);
+        return NULL;
+    }
+    if(baud <= 0) {
+        stmSetError(STM_ERROR_UNSUPPORTED, "baud rate %d is not supported",
+                baud);
+        return NULL;
+    }
+
+    LoopbackDev *dev = malloc(sizeof(LoopbackDev));
+    if(!dev) abort();
+
+    dev->sim = Simulator_create(&config);
+    if(!dev->sim) goto SimulatorError;
+
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        stmSetError(STM_ERROR_IO, "unable to create a socket pair: %s",
+                strerror(errno));
+        goto SocketError;
+    }
+    dev->fd = fds[0];
+    dev->simFd = fds[1];
+    (void)fcntl(dev->fd, F_SETFL, fcntl(dev->fd, F_GETFL) | O_NONBLOCK);
+
+    if(pthread_create(&dev->thread, NULL, runSimulator, dev) != 0) {
+        stmSetError(STM_ERROR_IO, "unable to start the simulator");
+        goto ThreadError;
+    }
+
+    dev->base.baud = config.baud > 0 ? config.baud : baud;
+    return &dev->base;
+
+ThreadError:
+    close(dev->fd);
+    close(dev->simFd);
+SocketError:
+    Simulator_destroy(dev->sim);
+SimulatorError:
+    free(dev);
+    return NULL;
+}
+
+static void loopbackClose(SerialDev *dev) {
+    LoopbackDev *loopback = (LoopbackDev *)dev;
+
+    /* The simulator stops when it sees the end of its input. */
+    (void)shutdown(loopback->fd, SHUT_WR);
+    (void)pthread_join(loopback->thread, NULL);
+    close(loopback->fd);
+    close(loopback->simFd);
+    Simulator_destroy(loopback->sim);
+    free(loopback);
+}
+
+static ssize_t loopbackRead(SerialDev *dev, uint8_t *buffer, size_t n,
+        uint64_t deadline) {
+    return stmSerialFdRead(((LoopbackDev *)dev)->fd, buffer, n, deadline);
+}
+
+static ssize_t loopbackWrite(SerialDev *dev, const uint8_t *buffer, size_t n,
+        uint64_t deadline) {
+    return stmSerialFdWrite(((LoopbackDev *)dev)->fd, buffer, n, deadline);
+}
+
+static bool loopbackFlush(SerialDev *dev) {
+    return stmSerialFdDiscardInput(((LoopbackDev *)dev)->fd);
+}
+
+static SerialLatency loopbackSetLowLatency(SerialDev *dev) {
+    (void)dev;
+    SerialLatency result = { false, -1 };
+    return result;
+}
+
+static bool loopbackSetDtr(SerialDev *dev, bool dtr) {
+    /* The simulator resets on every sync byte instead. */
+    (void)dev;
+    (void)dtr;
+    return true;
+}
+
+static bool parseOptions(const char *options, SimConfig *config) {
+    char *copy = strdup(options);
+    if(!copy) return false;
+
+    bool ok = true;
+    char *save = NULL;
+    for(char *option = strtok_r(copy, ",", &save); option && ok;
+            option = strtok_r(NULL, ",", &save)) {
+        const char *value = strchr(option, '=');
+        value = value ? value + 1 : "";
+        if(option[1] != '=' && option[1] != '\0') {
+            ok = false;
+            break;
+        }
+        switch(option[0]) {
+        case 'i': config->id = strtol(value, NULL, 0);            break;
+        case 'b': config->baud = atoi(value);                     break;
+        case 'E': config->eraseLatency = atol(value);             break;
+        case 'W': config->writeLatency = atol(value);             break;
+        case 't': config->turnaround = atol(value);               break;
+        case 'f': config->failEvery = strtoul(value, NULL, 0);    break;
+        case 'p': config->pageSize = strtol(value, NULL, 0);      break;
+        case 's': config->flashSize = strtol(value, NULL, 0);     break;
+        case 'x': config->extendedErase = true;                   break;
+        default:  ok = false;                                     break;
+        }
+    }
+
+    free(copy);
+    return ok;
+}
+
+static void *runSimulator(void *arg) {
+    LoopbackDev *dev = arg;
+
+    Simulator_run(dev->sim, dev->simFd);
+    return NULL;
+}
@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+
+#include "serial-transport.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hex.h"
+
+/* Log format, one transfer per line:
+ *
+ *   > USEC HEX    bytes written
+ *   < USEC HEX    bytes read
+ *   ! USEC        a read deadline passed
+ *   D USEC 0|1    DTR changed
+ *
+ * USEC is the time since the device was opened.  Lines starting with '#'
+ * are comments. */
+
+/** Records the traffic of another device. */
+typedef struct {
+    SerialDev base;
+    /** The device being recorded. */
+    SerialDev *inner;
+    FILE *log;
+    /** stmSerialClock() time when the device was opened. */
+    uint64_t start;
+} RecordDev;
+
+/** A transfer read from a log. */
+typedef struct {
+    /** The line type: '>', '<' or '!'. */
+    char type;
+    size_t length;
+    uint8_t *data;
+} Event;
+
+/** Plays back a log.  Writes are checked against the recorded ones and
+ * reads return the recorded data without waiting, so a session replays
+ * identically and as fast as the host can run it. */
+typedef struct {
+    SerialDev base;
+    Event *events;
+    size_t count;
+    /** The next event to play. */
+    size_t next;
+    /** Bytes of the next event already played. */
+    size_t offset;
+} ReplayDev;
+
+static SerialDev *recordOpen(const char *name, int baud);
+static void recordClose(SerialDev *dev);
+static ssize_t recordRead(SerialDev *dev, uint8_t *buffer, size_t n,
+        uint64_t deadline);
+static ssize_t recordWrite(SerialDev *dev, const uint8_t *buffer, size_t n,
+        uint64_t deadline);
+static bool recordFlush(SerialDev *dev);
+static SerialLatency recordSetLowLatency(SerialDev *dev);
+static bool recordSetDtr(SerialDev *dev, bool dtr);
+
+static SerialDev *replayOpen(const char *name, int baud);
+static void replayClose(SerialDev *dev);
+static ssize_t replayRead(SerialDev *dev, uint8_t *buffer, size_t n,
+        uint64_t deadline);
+static ssize_t replayWrite(SerialDev *dev, const uint8_t *buffer, size_t n,
+        uint64_t deadline);
+static bool replayFlush(SerialDev *dev);
+static SerialLatency replaySetLowLatency(SerialDev *dev);
+static bool replaySetDtr(SerialDev *dev, bool dtr);
+
+/** \brief Append a transfer to a recording.
+ *
+ * \param dev The recording device.
+ * \param type The line type.
+ * \param data The bytes transferred.
+ * \param n The number of bytes.
+ */
+static void logEvent(RecordDev *dev, char type, const uint8_t *data,
+        size_t n);
+
+/** \brief Parse a line of a recording.
+ *
+ * \param line The line, without a line terminator.
+ * \param event The event to fill in.
+ *
+ * \return \c true on success, \c false if the line is malformed.
+ */
+static bool parseEvent(const char *line, Event *event);
+
+
+const SerialTransport STM_RECORD_TRANSPORT = {
+    .prefix = "record:",
+    .open = recordOpen,
+    .close = recordClose,
+    .read = recordRead,
+    .write = recordWrite,
+    .flush = recordFlush,
+    .setLowLatency = recordSetLowLatency,
+    .setDtr = recordSetDtr
+};
+
+const SerialTransport STM_REPLAY_TRANSPORT = {
+    .prefix = "replay:",
+    .open = replayOpen,
+    .close = replayClose,
+    .read = replayRead,
+    .write = replayWrite,
+    .flush = replayFlush,
+    .setLowLatency = replaySetLowLatency,
+    .setDtr = replaySetDtr
+};
+
+static SerialDev *recordOpen(const char *name, int baud) {
+    /* The name is LOG:DEVICE, where DEVICE may have a prefix of its own. */
+    const char *devName = strchr(name, ':');
+    if(!devName) {
+        stmSetError(STM_ERROR_FORMAT, "expected record:LOG:DEVICE, got \"%s\"",
+                name);
+        return NULL;
+    }
+    char *logName = strndup(name, devName - name);
+    if(!logName) abort();
+    ++devName;
+
+    RecordDev *dev = malloc(sizeof(RecordDev));
+    if(!dev) abort();
+
+    dev->log = fopen(logName, "w");
+    if(!dev->log) {
+        stmSetError(STM_ERROR_IO, "unable to open \"%s\" for writing: %s",
+                logName, strerror(errno));
+        goto LogOpenError;
+    }
+    dev->inner = stmSerialOpen(devName, baud);
+    if(!dev->inner) goto DeviceOpenError;
+
+    fprintf(dev->log, "# %s at %d baud\n", devName,
+            stmSerialGetBaud(dev->inner));
+    dev->base.baud = stmSerialGetBaud(dev->inner);
+    dev->start = stmSerialClock();
+    free(logName);
+    return &dev->base;
+
+DeviceOpenError:
+    fclose(dev->log);
+LogOpenError:
+    free(dev);
+    free(logName);
+    return NULL;
+}
+
+static void recordClose(SerialDev *dev) {
+    RecordDev *record = (RecordDev *)dev;
+
+    stmSerialClose(record->inner);
+    fclose(record->log);
+    free(record);
+}
+
+static ssize_t recordRead(SerialDev *dev, uint8_t *buffer, size_t n,
+        uint64_t deadline) {
+    RecordDev *record = (RecordDev *)dev;
+    SerialDev *inner = record->inner;
+
+    ssize_t result = inner->transport->read(inner, buffer, n, deadline);
+    if(result > 0) logEvent(record, '<', buffer, result);
+    else if(result == 0) logEvent(record, '!', NULL, 0);
+    return result;
+}
+
+static ssize_t recordWrite(SerialDev *dev, const uint8_t *buffer, size_t n,
+        uint64_t deadline) {
+    RecordDev *record = (RecordDev *)dev;
+    SerialDev *inner = record->inner;
+
+    ssize_t result = inner->transport->write(inner, buffer, n, deadline);
+    if(result > 0) logEvent(record, '>', buffer, result);
+    return result;
+}
+
+static bool recordFlush(SerialDev *dev) {
+    return stmSerialFlush(((RecordDev *)dev)->inner);
+}
+
+static SerialLatency recordSetLowLatency(SerialDev *dev) {
+    return stmSerialSetLowLatency(((RecordDev *)dev)->inner);
+}
+
+static bool recordSetDtr(SerialDev *dev, bool dtr) {
+    RecordDev *record = (RecordDev *)dev;
+
+    fprintf(record->log, "D %llu %d\n",
+            (unsigned long long)(stmSerialClock() - record->start), dtr);
+    return stmSerialSetDtr(record->inner, dtr);
+}
+
+static SerialDev *replayOpen(const char *name, int baud) {
+    if(baud <= 0) {
+        stmSetError(STM_ERROR_UNSUPPORTED, "baud rate %d is not supported",
+                baud);
+        return NULL;
+    }
+
+    FILE *log = fopen(name, "r");
+    if(!log) {
+        stmSetError(STM_ERROR_IO, "unable to open \"%s\" for reading: %s",
+                name, strerror(errno));
+        return NULL;
+    }
+
+    ReplayDev *dev = calloc(1, sizeof(ReplayDev));
+    if(!dev) abort();
+
+    char *line = NULL;
+    size_t lineSize = 0;
+    size_t capacity = 0;
+    size_t lineNumber = 0;
+    ssize_t length;
+    while((length = getline(&line, &lineSize, log)) != -1) {
+        ++lineNumber;
+        while(length > 0 && (line[length - 1] == '\n' ||
+                line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if(length == 0 || line[0] == '#' || line[0] == 'D') continue;
+
+        if(dev->count == capacity) {
+            capacity = capacity ? 2 * capacity : 256;
+            Event *events = realloc(dev->events, capacity * sizeof(Event));
+            if(!events) abort();
+            dev->events = events;
+        }
+        if(!parseEvent(line, &dev->events[dev->count])) {
+            stmSetError(STM_ERROR_FORMAT, "%s:%zu: malformed line", name,
+                    lineNumber);
+            goto ParseError;
+        }
+        ++dev->count;
+    }
+    free(line);
+    fclose(log);
+
+    dev->base.baud = baud;
+    return &dev->base;
+
+ParseError:
+    free(line);
+    replayClose(&dev->base);
+    fclose(log);
+    return NULL;
+}
+
+static void replayClose(SerialDev *dev) {
+    ReplayDev *replay = (ReplayDev *)dev;
+
+    for(size_t i = 0; i < replay->count; ++i) free(replay->events[i].data);
+    free(replay->events);
+    free(replay);
+}
+
+static ssize_t replayRead(SerialDev *dev, uint8_t *buffer, size_t n,
+        uint64_t deadline) {
+    ReplayDev *replay = (ReplayDev *)dev;
+    (void)deadline;
+
+    if(replay->next == replay->count) {
+        stmSetError(STM_ERROR_PROTOCOL, "replay ended before a read");
+        return -1;
+    }
+    Event *event = &replay->events[replay->next];
+    if(event->type == '!') {
+        ++replay->next;
+        return 0;
+    }
+    if(event->type != '<') {
+        stmSetError(STM_ERROR_PROTOCOL,
+                "replay diverged: read where event %zu is a write",
+                replay->next);
+        return -1;
+    }
+
+    size_t length = event->length - replay->offset;
+    if(length > n) length = n;
+    memcpy(buffer, event->data + replay->offset, length);
+    replay->offset += length;
+    if(replay->offset == event->length) {
+        ++replay->next;
+        replay->offset = 0;
+    }
+    return length;
+}
+
+static ssize_t replayWrite(SerialDev *dev, const uint8_t *buffer, size_t n,
+        uint64_t deadline) {
+    ReplayDev *replay = (ReplayDev *)dev;
+    (void)deadline;
+
+    if(replay->next == replay->count ||
+            replay->events[replay->next].type != '>') {
+        stmSetError(STM_ERROR_PROTOCOL,
+                "replay diverged: write where event %zu is not one",
+                replay->next);
+        return -1;
+    }
+    Event *event = &replay->events[replay->next];
+
+    size_t length = event->length - replay->offset;
+    if(length > n) length = n;
+    if(memcmp(buffer, event->data + replay->offset, length)) {
+        stmSetError(STM_ERROR_PROTOCOL,
+                "replay diverged: event %zu wrote different data",
+                replay->next);
+        return -1;
+    }
+    replay->offset += length;
+    if(replay->offset == event->length) {
+        ++replay->next;
+        replay->offset = 0;
+    }
+    return length;
+}
+
+static bool replayFlush(SerialDev *dev) {
+    /* Input dropped while recording was never logged. */
+    (void)dev;
+    return true;
+}
+
+static SerialLatency replaySetLowLatency(SerialDev *dev) {
+    (void)dev;
+    SerialLatency result = { false, -1 };
+    return result;
+}
+
+static bool replaySetDtr(SerialDev *dev, bool dtr) {
+    (void)dev;
+    (void)dtr;
+    return true;
+}
+
+static void logEvent(RecordDev *dev, char type, const uint8_t *data,
+        size_t n) {
+    fprintf(dev->log, "%c %llu", type,
+            (unsigned long long)(stmSerialClock() - dev->start));
+    if(n) fputc(' ', dev->log);
+    for(size_t i = 0; i < n; ++i) fprintf(dev->log, "%02x", data[i]);
+    fputc('\n', dev->log);
+}
+
+static bool parseEvent(const char *line, Event *event) {
+    event->type = line[0];
+    event->length = 0;
+    event->data = NULL;
+    if(event->type != '>' && event->type != '<' && event->type != '!') {
+        return false;
+    }
+
+    /* Skip the type and the time stamp. */
+    const char *hex = line + 1;
+    while(*hex == ' ') ++hex;
+    while(*hex >= '0' && *hex <= '9') ++hex;
+    while(*hex == ' ') ++hex;
+
+    size_t digits = strlen(hex);
+    if(digits % 2 || (event->type == '!') != (digits == 0)) return false;
+    if(!digits) return true;
+
+    event->length = digits / 2;
+    event->data = malloc(event->length);
+    if(!event->data) return false;
+    if(!decodeHex(hex, event->length, event->data)) {
+        free(event->data);
+        event->data = NULL;
+        return false;
+    }
+    return true;
+}
+
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+
+#include "serial-transport.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/** A raw TCP connection to a serial bridge.  The bridge owns the line
+ * settings, so the baud rate is only used to estimate transfer times. */
+typedef struct {
+    SerialDev base;
+    /** The connected socket. */
+    int fd;
+} TcpDev;
+
+static SerialDev *tcpOpen(const char *name, int baud);
+static void tcpClose(SerialDev *dev);
+static ssize_t tcpRead(SerialDev *dev, uint8_t *buffer, size_t n,
+        uint64_t deadline);
+static ssize_t tcpWrite(SerialDev *dev, const uint8_t *buffer, size_t n,
+        uint64_t deadline);
+static bool tcpFlush(SerialDev *dev);
+static SerialLatency tcpSetLowLatency(SerialDev *dev);
+static bool tcpSetDtr(SerialDev *dev, bool dtr);
+
+/** \brief Connect to a TCP server.
+ *
+ * \param name The server as HOST:PORT.  IPv6 addresses are written in
+ *             brackets, as in [::1]:2000.
+ *
+ * \return The connected socket, or -1 on failure.
+ */
+static int tcpConnect(const char *name);
+
+const SerialTransport STM_TCP_TRANSPORT = {
+    .prefix = "tcp:",
+    .open = tcpOpen,
+    .close = tcpClose,
+    .read = tcpRead,
+    .write = tcpWrite,
+    .flush = tcpFlush,
+    .setLowLatency = tcpSetLowLatency,
+    .setDtr = tcpSetDtr
+};
+
+static SerialDev *tcpOpen(const char *name, int baud) {
+    if(baud <= 0) {
+        stmSetError(STM_ERROR_UNSUPPORTED, "baud rate %d is not supported",
+                baud);
+        return NULL;
+    }
+
+    TcpDev *dev = malloc(sizeof(TcpDev));
+    if(!dev) abort();
+
+    dev->fd = tcpConnect(name);
+    if(dev->fd == -1) {
+        stmSetError(STM_ERROR_IO, "unable to connect to \"%s\"", name);
+        free(dev);
+        return NULL;
+    }
+
+    /* Every command waits for a reply, so small segments must go out
+     * immediately. */
+    int on = 1;
+    (void)setsockopt(dev->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    (void)fcntl(dev->fd, F_SETFL, fcntl(dev->fd, F_GETFL) | O_NONBLOCK);
+
+    dev->base.baud = baud;
+    return &dev->base;
+}
+
+static void tcpClose(SerialDev *dev) {
+    TcpDev *tcp = (TcpDev *)dev;
+
+    close(tcp->fd);
+    free(tcp);
+}
+
+static ssize_t tcpRead(SerialDev *dev, uint8_t *buffer, size_t n,
+        uint64_t deadline) {
+    return stmSerialFdRead(((TcpDev *)dev)->fd, buffer, n, deadline);
+}
+
+static ssize_t tcpWrite(SerialDev *dev, const uint8_t *buffer, size_t n,
+        uint64_t deadline) {
+    return stmSerialFdWrite(((TcpDev *)dev)->fd, buffer, n, deadline);
+}
+
+static bool tcpFlush(SerialDev *dev) {
+    return stmSerialFdDiscardInput(((TcpDev *)dev)->fd);
+}
+
+static SerialLatency tcpSetLowLatency(SerialDev *dev) {
+    (void)dev;
+    SerialLatency result = { false, -1 };
+    return result;
+}
+
+static bool tcpSetDtr(SerialDev *dev, bool dtr) {
+    /* Modem control needs RFC 2217 option negotiation. */
+    (void)dev;
+    (void)dtr;
+    return false;
+}
+
+static int tcpConnect(const char *name) {
+    char host[256];
+    const char *port = strrchr(name, ':');
+    if(!port || (size_t)(port - name) >= sizeof(host)) return -1;
+
+    size_t length = port - name;
+    if(length >= 2 && name[0] == '[' && name[length - 1] == ']') {
+        memcpy(host, name + 1, length - 2);
+        host[length - 2] = '\0';
+    } else {
+        memcpy(host, name, length);
+        host[length] = '\0';
+    }
+    ++port;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addrs;
+    if(getaddrinfo(host, port, &hints, &addrs) != 0) return -1;
+
+    int fd = -1;
+    for(struct addrinfo *addr = addrs; addr; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if(fd == -1) continue;
+        if(connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
@@ -0,0 +1,85 @@
+#ifndef STM32SPROG_SERIAL_TRANSPORT_H
+#define STM32SPROG_SERIAL_TRANSPORT_H
+/** \file serial-transport.h
+ *
+ * Interface between serial.c and the transports that carry the byte stream.
+ * Each transport embeds \ref SSerialDev as the first member of its own device
+ * structure.
+ */
+
+#include <sys/types.h>
+
+#include "serial.h"
+
+typedef struct SerialTransport SerialTransport;
+
+/** Operations of a transport.  Deadlines are in stmSerialClock() time. */
+struct SerialTransport {
+    /** Device name prefix selecting this transport, e.g. "tcp:".  An empty
+     * prefix matches any name. */
+    const char *prefix;
+
+    /** Open a device.  The name has the prefix removed.  Sets the baud field
+     * of the new device; stmSerialOpen() fills in the rest.  Records why
+     * with stmSetError() if it returns NULL. */
+    SerialDev *(*open)(const char *name, int baud);
+    /** Close a device and free it. */
+    void (*close)(SerialDev *dev);
+    /** Read up to \a n bytes, waiting until at least one is available.
+     * Returns the number of bytes read, 0 if the deadline passed, or -1 on
+     * error after recording it with stmSetError(). */
+    ssize_t (*read)(SerialDev *dev, uint8_t *buffer, size_t n,
+            uint64_t deadline);
+    /** Write up to \a n bytes, waiting until at least one can be written.
+     * Returns as read does. */
+    ssize_t (*write)(SerialDev *dev, const uint8_t *buffer, size_t n,
+            uint64_t deadline);
+    /** As stmSerialFlush(). */
+    bool (*flush)(SerialDev *dev);
+    /** As stmSerialSetLowLatency(). */
+    SerialLatency (*setLowLatency)(SerialDev *dev);
+    /** As stmSerialSetDtr(). */
+    bool (*setDtr)(SerialDev *dev, bool dtr);
+};
+
+/** Data common to all serial devices. */
+struct SSerialDev {
+    /** The transport carrying the data. */
+    const SerialTransport *transport;
+    /** The baud rate configured by the driver. */
+    int baud;
+    /** Timeout in milliseconds for stmSerialRead() and stmSerialWrite(). */
+    unsigned timeout;
+};
+
+/** Character devices: serial ports and pseudo-terminals. */
+extern const SerialTransport STM_TTY_TRANSPORT;
+/** Raw TCP connections to a serial bridge such as ser2net. */
+extern const SerialTransport STM_TCP_TRANSPORT;
+/** A simulated target running in a thread of this process. */
+extern const SerialTransport STM_LOOPBACK_TRANSPORT;
+/** Records the traffic of another device to a log file. */
+extern const SerialTransport STM_RECORD_TRANSPORT;
+/** Plays back a log written by \ref STM_RECORD_TRANSPORT. */
+extern const SerialTransport STM_REPLAY_TRANSPORT;
+
+/** \brief Read from a non-blocking file descriptor before a deadline.
+ *
+ * Implements SerialTransport::read for descriptor based transports.
+ */
+ssize_t stmSerialFdRead(int fd, uint8_t *buffer, size_t n, uint64_t deadline);
+
+/** \brief Write to a non-blocking file descriptor before a deadline.
+ *
+ * Implements SerialTransport::write for descriptor based transports.
+ */
+ssize_t stmSerialFdWrite(int fd, const uint8_t *buffer, size_t n,
+        uint64_t deadline);
+
+/** \brief Drop any input waiting on a non-blocking file descriptor.
+ *
+ * \return \c true on success, \c false if any error occurred.
+ */
+bool stmSerialFdDiscardInput(int fd);
+
+#endif /* STM32SPROG_SERIAL_TRANSPORT_H */
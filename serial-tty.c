@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+
+#include "serial-transport.h"
+#include "serial-baud.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+/** Latency timer requested from USB-serial adapters, in milliseconds. */
+static const int MIN_LATENCY_TIMER = 1;
+
+/** A serial port or pseudo-terminal. */
+typedef struct {
+    SerialDev base;
+    /** The file descriptor for the open serial device. */
+    int fd;
+} TtyDev;
+
+static SerialDev *ttyOpen(const char *devName, int baud);
+static void ttyClose(SerialDev *dev);
+static ssize_t ttyRead(SerialDev *dev, uint8_t *buffer, size_t n,
+        uint64_t deadline);
+static ssize_t ttyWrite(SerialDev *dev, const uint8_t *buffer, size_t n,
+        uint64_t deadline);
+static bool ttyFlush(SerialDev *dev);
+static SerialLatency ttySetLowLatency(SerialDev *dev);
+static bool ttySetDtr(SerialDev *dev, bool dtr);
+
+/** \brief Set the latency timer of a USB-serial adapter through sysfs.
+ *
+ * \param fd The file descriptor of the open serial device.
+ * \param latency The requested latency in milliseconds.
+ *
+ * \return The latency timer value after the change, or -1 if the adapter
+ *         does not have one.
+ */
+static int setLatencyTimer(int fd, int latency);
+
+const SerialTransport STM_TTY_TRANSPORT = {
+    .prefix = "",
+    .open = ttyOpen,
+    .close = ttyClose,
+    .read = ttyRead,
+    .write = ttyWrite,
+    .flush = ttyFlush,
+    .setLowLatency = ttySetLowLatency,
+    .setDtr = ttySetDtr
+};
+
+static speed_t convertBaud(int baud) {
+    switch(baud) {
+    case 1200:   return B1200;
+    case 1800:   return B1800;
+    case 2400:   return B2400;
+    case 4800:   return B4800;
+    case 9600:   return B9600;
+    case 19200:  return B19200;
+    case 38400:  return B38400;
+    case 57600:  return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    default:     return B0;
+    }
+}
+
+static SerialDev *ttyOpen(const char *devName, int baud) {
+    speed_t localBaud = convertBaud(baud);
+    if(baud <= 0 || (localBaud == B0 && !stmSerialArbitraryBaud())) {
+        stmSetError(STM_ERROR_UNSUPPORTED, "baud rate %d is not supported",
+                baud);
+        return NULL;
+    }
+
+    TtyDev *dev = malloc(sizeof(TtyDev));
+    if(!dev) abort();
+
+    dev->fd = open(devName, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(dev->fd == -1) {
+        stmSetError(STM_ERROR_IO, "unable to open \"%s\": %s", devName,
+                strerror(errno));
+        goto DeviceOpenError;
+    }
+
+    struct termios opts;
+    cfmakeraw(&opts);
+    opts.c_cflag &= ~CSTOPB;
+    opts.c_cflag |= PARENB;
+    opts.c_cflag &= ~PARODD;
+    /* Reads never block; waiting is done with poll() and a deadline. */
+    opts.c_cc[VMIN] = 0;
+    opts.c_cc[VTIME] = 0;
+    /* Rates without a Bxxx constant are set below. */
+    if(cfsetspeed(&opts, localBaud == B0 ? B38400 : localBaud) == -1) {
+        stmSetError(STM_ERROR_IO, "unable to set the baud rate: %s",
+                strerror(errno));
+        goto DeviceConfigError;
+    }
+    if(tcsetattr(dev->fd, TCSANOW, &opts) == -1) {
+        stmSetError(STM_ERROR_IO, "unable to configure \"%s\": %s", devName,
+                strerror(errno));
+        goto DeviceConfigError;
+    }
+
+    dev->base.baud = baud;
+    if(stmSerialArbitraryBaud()) {
+        int actual = stmSerialSetBaudRate(dev->fd, baud);
+        if(actual > 0) {
+            dev->base.baud = actual;
+        } else if(localBaud == B0) {
+            stmSetError(STM_ERROR_UNSUPPORTED,
+                    "baud rate %d is not supported", baud);
+            goto DeviceConfigError;
+        }
+    }
+
+    return &dev->base;
+
+DeviceConfigError:
+    close(dev->fd);
+DeviceOpenError:
+    free(dev);
+    return NULL;
+}
+
+static void ttyClose(SerialDev *dev) {
+    TtyDev *tty = (TtyDev *)dev;
+
+    close(tty->fd);
+    free(tty);
+}
+
+static ssize_t ttyRead(SerialDev *dev, uint8_t *buffer, size_t n,
+        uint64_t deadline) {
+    return stmSerialFdRead(((TtyDev *)dev)->fd, buffer, n, deadline);
+}
+
+static ssize_t ttyWrite(SerialDev *dev, const uint8_t *buffer, size_t n,
+        uint64_t deadline) {
+    return stmSerialFdWrite(((TtyDev *)dev)->fd, buffer, n, deadline);
+}
+
+static bool ttyFlush(SerialDev *dev) {
+    TtyDev *tty = (TtyDev *)dev;
+
+    if(tcdrain(tty->fd) == -1) return false;
+    return tcflush(tty->fd, TCIFLUSH) == 0;
+}
+
+static SerialLatency ttySetLowLatency(SerialDev *dev) {
+    TtyDev *tty = (TtyDev *)dev;
+    SerialLatency result = { false, -1 };
+
+#ifdef __linux__
+    struct serial_struct info;
+    if(ioctl(tty->fd, TIOCGSERIAL, &info) == 0) {
+        info.flags |= ASYNC_LOW_LATENCY;
+        if(ioctl(tty->fd, TIOCSSERIAL, &info) == 0 &&
+                ioctl(tty->fd, TIOCGSERIAL, &info) == 0) {
+            result.lowLatency = (info.flags & ASYNC_LOW_LATENCY) != 0;
+        }
+    }
+    result.latencyTimer = setLatencyTimer(tty->fd, MIN_LATENCY_TIMER);
+#else
+    (void)tty;
+#endif
+
+    return result;
+}
+
+static bool ttySetDtr(SerialDev *dev, bool dtr) {
+    TtyDev *tty = (TtyDev *)dev;
+
+    int status;
+    if(ioctl(tty->fd, TIOCMGET, &status) != 0) return false;
+
+    if(dtr) status |= TIOCM_DTR;
+    else status &= ~TIOCM_DTR;
+
+    return ioctl(tty->fd, TIOCMSET, &status) == 0;
+}
+
+static int setLatencyTimer(int fd, int latency) {
+    const char *name = ttyname(fd);
+    if(!name) return -1;
+    const char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device/latency_timer",
+            base);
+
+    /* Writing needs permission on the attribute; report the value in effect
+     * either way. */
+    FILE *file = fopen(path, "w");
+    if(file) {
+        fprintf(file, "%d\n", latency);
+        fclose(file);
+    }
+
+    int result = -1;
+    file = fopen(path, "r");
+    if(file) {
+        if(fscanf(file, "%d", &result) != 1) result = -1;
+        fclose(file);
+    }
+    return result;
+}
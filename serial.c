@@ -1,130 +1,231 @@
+#define _GNU_SOURCE
+
 #include "serial.h"
+#include "serial-transport.h"
 
 #include <assert.h>
-#include <fcntl.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <sys/ioctl.h>
-#include <termios.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-/** Data to track a serial device connection. */
-struct SSerialDev {
-    /** The file descriptor for the open serial device. */
-    int fd;
-};
+static const unsigned DEFAULT_TIMEOUT = 1000;
 
-static speed_t convertBaud(int baud) {
-    switch(baud) {
-    case 1200:   return B1200;
-    case 1800:   return B1800;
-    case 2400:   return B2400;
-    case 4800:   return B4800;
-    case 9600:   return B9600;
-    case 19200:  return B19200;
-    case 38400:  return B38400;
-    case 57600:  return B57600;
-    case 115200: return B115200;
-    case 230400: return B230400;
-    default:     return B0;
-    }
-}
+/** Bits per byte on the wire: start bit, 8 data bits, parity and stop bit. */
+static const int BITS_PER_BYTE = 11;
+
+/** Transports by device name prefix.  The last one matches any name. */
+static const SerialTransport *const TRANSPORTS[] = {
+    &STM_TCP_TRANSPORT,
+    &STM_LOOPBACK_TRANSPORT,
+    &STM_RECORD_TRANSPORT,
+    &STM_REPLAY_TRANSPORT,
+    &STM_TTY_TRANSPORT
+};
 
-SerialDev *serialOpen(const char *devName, int baud) {
+/** \brief Wait until a file descriptor is ready or a deadline passes.
+ *
+ * \param fd The file descriptor.
+ * \param events The poll() events to wait for.
+ * \param deadline The deadline, in stmSerialClock() time.
+ *
+ * \return SERIAL_OK when ready, SERIAL_TIMEOUT or SERIAL_ERROR otherwise.
+ */
+static SerialStatus waitReady(int fd, short events, uint64_t deadline);
+
+/** \brief Compute the deadline for a transfer with the default timeout.
+ *
+ * \param dev An open serial device.
+ * \param n The number of bytes to transfer.
+ *
+ * \return The deadline, allowing for the time the bytes take on the wire.
+ */
+static uint64_t defaultDeadline(SerialDev *dev, size_t n);
+
+SerialDev *stmSerialOpen(const char *devName, int baud) {
     assert(devName);
 
-    speed_t localBaud = convertBaud(baud);
-    if(localBaud == B0) {
-        fprintf(stderr, "Baud rate \"%d\" is not supported.\n", baud);
-        return NULL;
+    const SerialTransport *transport = NULL;
+    for(size_t i = 0; i < sizeof(TRANSPORTS) / sizeof(*TRANSPORTS); ++i) {
+        size_t length = strlen(TRANSPORTS[i]->prefix);
+        if(!strncmp(devName, TRANSPORTS[i]->prefix, length)) {
+            transport = TRANSPORTS[i];
+            devName += length;
+            break;
+        }
     }
+    assert(transport);
 
-    SerialDev *dev = malloc(sizeof(SerialDev));
+    SerialDev *dev = transport->open(devName, baud);
     if(!dev) return NULL;
 
-    dev->fd = open(devName, O_RDWR | O_NOCTTY);
-    if(dev->fd == -1) {
-        fprintf(stderr, "Unable to open device \"%s\"\n", devName);
-        goto DeviceOpenError;
-    }
+    dev->transport = transport;
+    dev->timeout = DEFAULT_TIMEOUT;
+    return dev;
+}
 
-    struct termios opts;
-    cfmakeraw(&opts);
-    opts.c_cflag &= ~CSTOPB;
-    opts.c_cflag |= PARENB;
-    opts.c_cflag &= ~PARODD;
-    opts.c_cc[VMIN] = 0;
-    opts.c_cc[VTIME] = 5;
-    if(cfsetspeed(&opts, localBaud) == -1) {
-        fprintf(stderr, "Unable to set baud rate.\n");
-        goto DeviceConfigError;
-    }
-    if(tcsetattr(dev->fd, TCSANOW, &opts) == -1) {
-        fprintf(stderr, "Unable to set serial device options.\n");
-        goto DeviceConfigError;
-    }
+void stmSerialClose(SerialDev *dev) {
+    assert(dev);
 
-    return dev;
+    dev->transport->close(dev);
+}
 
-DeviceConfigError:
-    close(dev->fd);
-DeviceOpenError:
-    free(dev);
-    return NULL;
+int stmSerialGetBaud(SerialDev *dev) {
+    assert(dev);
+
+    return dev->baud;
 }
 
-void serialClose(SerialDev *dev) {
+void stmSerialSetTimeout(SerialDev *dev, unsigned timeout) {
     assert(dev);
 
-    close(dev->fd);
-    free(dev);
+    dev->timeout = timeout;
+}
+
+uint64_t stmSerialClock(void) {
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-bool serialRead(SerialDev *dev, uint8_t *buffer, size_t n) {
+SerialStatus stmSerialReadDeadline(SerialDev *dev, uint8_t *buffer, size_t n,
+        uint64_t deadline) {
     assert(dev);
     assert(buffer);
 
     while(n) {
-        ssize_t result = read(dev->fd, buffer, n);
-        if(result > 0) {
-            buffer += result;
-            n -= result;
-        } else if(result < 0) {
-            fprintf(stderr, "Read error.\n");
-            return false;
+        ssize_t result = dev->transport->read(dev, buffer, n, deadline);
+        if(result == 0) {
+            stmSetError(STM_ERROR_TIMEOUT, "no answer from the device");
+            return SERIAL_TIMEOUT;
         }
+        /* The transport has recorded why. */
+        if(result < 0) return SERIAL_ERROR;
+        buffer += result;
+        n -= result;
     }
 
-    return true;
+    return SERIAL_OK;
 }
 
-bool serialWrite(SerialDev *dev, const uint8_t *buffer, size_t n) {
+SerialStatus stmSerialWriteDeadline(SerialDev *dev, const uint8_t *buffer,
+        size_t n, uint64_t deadline) {
     assert(dev);
     assert(buffer);
 
     while(n) {
-        ssize_t result = write(dev->fd, buffer, n);
-        if(result > 0) {
-            buffer += result;
-            n -= result;
-        } else if(result < 0) {
-            fprintf(stderr, "Write error.\n");
-            return false;
+        ssize_t result = dev->transport->write(dev, buffer, n, deadline);
+        if(result == 0) {
+            stmSetError(STM_ERROR_TIMEOUT, "the device did not take data");
+            return SERIAL_TIMEOUT;
         }
+        if(result < 0) return SERIAL_ERROR;
+        buffer += result;
+        n -= result;
     }
 
-    return true;
+    return SERIAL_OK;
+}
+
+bool stmSerialRead(SerialDev *dev, uint8_t *buffer, size_t n) {
+    return stmSerialReadDeadline(dev, buffer, n, defaultDeadline(dev, n)) ==
+            SERIAL_OK;
 }
 
-bool serialSetDtr(SerialDev *dev, bool dtr) {
+bool stmSerialWrite(SerialDev *dev, const uint8_t *buffer, size_t n) {
+    return stmSerialWriteDeadline(dev, buffer, n, defaultDeadline(dev, n)) ==
+            SERIAL_OK;
+}
+
+bool stmSerialFlush(SerialDev *dev) {
     assert(dev);
 
-    int status;
-    if(ioctl(dev->fd, TIOCMGET, &status) != 0) return false;
+    return dev->transport->flush(dev);
+}
 
-    if(dtr) status |= TIOCM_DTR;
-    else status &= ~TIOCM_DTR;
+SerialLatency stmSerialSetLowLatency(SerialDev *dev) {
+    assert(dev);
+
+    return dev->transport->setLowLatency(dev);
+}
+
+bool stmSerialSetDtr(SerialDev *dev, bool dtr) {
+    assert(dev);
+
+    return dev->transport->setDtr(dev, dtr);
+}
 
-    return ioctl(dev->fd, TIOCMSET, &status) == 0;
+ssize_t stmSerialFdRead(int fd, uint8_t *buffer, size_t n, uint64_t deadline) {
+    bool polled = false;
+    for(;;) {
+        ssize_t result = read(fd, buffer, n);
+        if(result > 0) return result;
+        /* Readable without data means that the peer has gone away. */
+        if(result == 0 && polled) {
+            stmSetError(STM_ERROR_IO, "the link was closed");
+            return -1;
+        }
+        if(result < 0 && errno != EAGAIN && errno != EINTR) {
+            stmSetError(STM_ERROR_IO, "read failed: %s", strerror(errno));
+            return -1;
+        }
+        SerialStatus status = waitReady(fd, POLLIN, deadline);
+        if(status == SERIAL_TIMEOUT) return 0;
+        if(status != SERIAL_OK) return -1;
+        polled = true;
+    }
 }
 
+ssize_t stmSerialFdWrite(int fd, const uint8_t *buffer, size_t n,
+        uint64_t deadline) {
+    for(;;) {
+        ssize_t result = write(fd, buffer, n);
+        if(result > 0) return result;
+        if(result < 0 && errno != EAGAIN && errno != EINTR) {
+            stmSetError(STM_ERROR_IO, "write failed: %s", strerror(errno));
+            return -1;
+        }
+        SerialStatus status = waitReady(fd, POLLOUT, deadline);
+        if(status == SERIAL_TIMEOUT) return 0;
+        if(status != SERIAL_OK) return -1;
+    }
+}
+
+bool stmSerialFdDiscardInput(int fd) {
+    uint8_t buffer[256];
+    for(;;) {
+        ssize_t result = read(fd, buffer, sizeof(buffer));
+        if(result > 0) continue;
+        if(result < 0 && errno == EINTR) continue;
+        return result == 0 || errno == EAGAIN;
+    }
+}
+
+static SerialStatus waitReady(int fd, short events, uint64_t deadline) {
+    for(;;) {
+        uint64_t now = stmSerialClock();
+        if(now >= deadline) return SERIAL_TIMEOUT;
+
+        uint64_t remaining = deadline - now;
+        struct timespec ts;
+        ts.tv_sec = remaining / 1000000;
+        ts.tv_nsec = (remaining % 1000000) * 1000;
+        struct pollfd pfd = { .fd = fd, .events = events, .revents = 0 };
+        int ready = ppoll(&pfd, 1, &ts, NULL);
+        if(ready > 0) {
+            if(pfd.revents & events) return SERIAL_OK;
+            stmSetError(STM_ERROR_IO, "the link failed");
+            return SERIAL_ERROR;
+        }
+        if(ready < 0 && errno != EINTR) {
+            stmSetError(STM_ERROR_IO, "poll failed: %s", strerror(errno));
+            return SERIAL_ERROR;
+        }
+    }
+}
+
+static uint64_t defaultDeadline(SerialDev *dev, size_t n) {
+    uint64_t wireTime = (uint64_t)n * BITS_PER_BYTE * 1000000 / dev->baud;
+    return stmSerialClock() + (uint64_t)dev->timeout * 1000 + wireTime;
+}
@@ -2,34 +2,111 @@
 #define STM32SPROG_SERIAL_H
 /** \file serial.h
  *
- * Provides a serial communication interface.
+ * Provides a serial communication interface.  Functions that fail record
+ * why, see stmLastError().
  */
 
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include "error.h"
+
 /** Serial device handle. */
 typedef struct SSerialDev SerialDev;
 
+/** Result of a serial transfer with a deadline. */
+typedef enum {
+    /** All data was transferred. */
+    SERIAL_OK = 0,
+    /** The deadline passed before all data was transferred. */
+    SERIAL_TIMEOUT = -1,
+    /** The device reported an error. */
+    SERIAL_ERROR = -2
+} SerialStatus;
+
+/** Latency settings in effect after stmSerialSetLowLatency(). */
+typedef struct {
+    /** Whether the driver runs in low latency mode (ASYNC_LOW_LATENCY). */
+    bool lowLatency;
+    /** The USB-serial adapter's latency timer in milliseconds, or -1 if the
+     * adapter does not expose one. */
+    int latencyTimer;
+} SerialLatency;
+
 /** \brief Open a serial device.
  *
  * \param devName The name of the device to open.
- * \param baud The baud rate.
+ * \param baud The baud rate.  Where the platform allows it, any rate is
+ *             accepted, not just the standard ones.
  *
  * \return A new \ref SerialDev, or NULL if the device could not be opened.
  */
-SerialDev *serialOpen(const char *devName, int baud);
+SerialDev *stmSerialOpen(const char *devName, int baud);
 
 /** \brief Close a serial device.  Frees resources used by the device.
  *
  * \param dev An open serial device.
  */
-void serialClose(SerialDev *dev);
+void stmSerialClose(SerialDev *dev);
+
+/** \brief Get the baud rate of a serial device.
+ *
+ * \param dev An open serial device.
+ *
+ * \return The baud rate actually configured, which may differ slightly from
+ *         the requested rate.
+ */
+int stmSerialGetBaud(SerialDev *dev);
+
+/** \brief Set the default timeout of a serial device.
+ *
+ * stmSerialRead() and stmSerialWrite() fail if they cannot complete within this
+ * time, plus the time the data takes on the wire.
+ *
+ * \param dev An open serial device.
+ * \param timeout The timeout in milliseconds.
+ */
+void stmSerialSetTimeout(SerialDev *dev, unsigned timeout);
+
+/** \brief Get the time base of serial deadlines.
+ *
+ * \return The CLOCK_MONOTONIC time in microseconds.
+ */
+uint64_t stmSerialClock(void);
+
+/** \brief Read data from a serial device before a deadline.
+ *
+ * \param dev An open serial device.
+ * \param buffer The data buffer to fill.
+ * \param n The number of bytes to read.
+ * \param deadline The time by which all data must be read, in stmSerialClock()
+ *                 time.
+ *
+ * \return SERIAL_OK on success, SERIAL_TIMEOUT if the deadline passed, or
+ *         SERIAL_ERROR if any other error occurred.
+ */
+SerialStatus stmSerialReadDeadline(SerialDev *dev, uint8_t *buffer, size_t n,
+        uint64_t deadline);
+
+/** \brief Write data to a serial device before a deadline.
+ *
+ * \param dev An open serial device.
+ * \param buffer The data to write.
+ * \param n The number of bytes to write.
+ * \param deadline The time by which all data must be written, in
+ *                 stmSerialClock() time.
+ *
+ * \return SERIAL_OK on success, SERIAL_TIMEOUT if the deadline passed, or
+ *         SERIAL_ERROR if any other error occurred.
+ */
+SerialStatus stmSerialWriteDeadline(SerialDev *dev, const uint8_t *buffer,
+        size_t n, uint64_t deadline);
 
 /** \brief Read data from a serial device.
  *
- * Blocks until all data has been read or an error has occurred.
+ * Blocks until all data has been read, the default timeout has expired or an
+ * error has occurred.
  *
  * \param dev An open serial device.
  * \param buffer The data buffer to fill.
@@ -37,11 +114,12 @@ void serialClose(SerialDev *dev);
  *
  * \return \c true on success, \c false if any error occurred.
  */
-bool serialRead(SerialDev *dev, uint8_t *buffer, size_t n);
+bool stmSerialRead(SerialDev *dev, uint8_t *buffer, size_t n);
 
 /** \brief Write data to a serial device.
  *
- * Blocks until all data has been written or an error has occurred.
+ * Blocks until all data has been written, the default timeout has expired or
+ * an error has occurred.
  *
  * \param dev An open serial device.
  * \param buffer The data to write.
@@ -49,7 +127,30 @@ bool serialRead(SerialDev *dev, uint8_t *buffer, size_t n);
  *
  * \return \c true on success, \c false if any error occurred.
  */
-bool serialWrite(SerialDev *dev, const uint8_t *buffer, size_t n);
+bool stmSerialWrite(SerialDev *dev, const uint8_t *buffer, size_t n);
+
+/** \brief Discard pending input on a serial device.
+ *
+ * Waits until all written data has been transmitted, then drops any data that
+ * has been received but not yet read.
+ *
+ * \param dev An open serial device.
+ *
+ * \return \c true on success, \c false if any error occurred.
+ */
+bool stmSerialFlush(SerialDev *dev);
+
+/** \brief Reduce the turnaround latency of a serial device.
+ *
+ * Requests ASYNC_LOW_LATENCY from the driver and, for USB-serial adapters
+ * that expose a latency_timer attribute in sysfs, lowers the latency timer.
+ * Either request may be refused, e.g. for lack of permissions.
+ *
+ * \param dev An open serial device.
+ *
+ * \return The settings in effect afterwards.
+ */
+SerialLatency stmSerialSetLowLatency(SerialDev *dev);
 
 /** \brief Set the state of the DTR signal for a serial device.
  *
@@ -58,7 +159,7 @@ bool serialWrite(SerialDev *dev, const uint8_t *buffer, size_t n);
  *
  * \return \c true on success, \c false if any error occurred.
  */
-bool serialSetDtr(SerialDev *dev, bool dtr);
+bool stmSerialSetDtr(SerialDev *dev, bool dtr);
 
 #endif /* STM32SPROG_SERIAL_H */
 
@@ -0,0 +1,104 @@
+#include "sha256.h"
+
+#include <string.h>
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void Sha256_compress(Sha256 *self, const uint8_t *block);
+
+static uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+void Sha256_init(Sha256 *self) {
+    static const uint32_t INITIAL[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(self->state, INITIAL, sizeof(INITIAL));
+    self->length = 0;
+}
+
+void Sha256_update(Sha256 *self, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    size_t used = self->length % sizeof(self->block);
+    self->length += length;
+
+    if(used) {
+        size_t n = sizeof(self->block) - used;
+        if(n > length) n = length;
+        memcpy(self->block + used, bytes, n);
+        bytes += n;
+        length -= n;
+        if(used + n < sizeof(self->block)) return;
+        Sha256_compress(self, self->block);
+    }
+    for(; length >= sizeof(self->block); length -= sizeof(self->block)) {
+        Sha256_compress(self, bytes);
+        bytes += sizeof(self->block);
+    }
+    memcpy(self->block, bytes, length);
+}
+
+void Sha256_final(Sha256 *self, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    /* A one bit, zeros up to 8 bytes short of a block boundary, and the
+     * length in bits. */
+    uint64_t bits = self->length * 8;
+    uint8_t padding[sizeof(self->block) + 8] = { 0x80 };
+    size_t used = self->length % sizeof(self->block);
+    size_t n = (used < 56 ? 56 : 120) - used;
+    for(int i = 0; i < 8; ++i) padding[n + i] = bits >> (56 - 8 * i);
+    Sha256_update(self, padding, n + 8);
+
+    for(int i = 0; i < 8; ++i) {
+        for(int j = 0; j < 4; ++j) {
+            digest[4 * i + j] = self->state[i] >> (24 - 8 * j);
+        }
+    }
+}
+
+static void Sha256_compress(Sha256 *self, const uint8_t *block) {
+    uint32_t w[64];
+    for(int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16
+                | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for(int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18)
+                ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19)
+                ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t v[8];
+    memcpy(v, self->state, sizeof(v));
+    for(int i = 0; i < 64; ++i) {
+        uint32_t s1 = rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + K[i] + w[i];
+        uint32_t s0 = rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        memmove(v + 1, v, 7 * sizeof(v[0]));
+        v[4] += t1;
+        v[0] = t1 + s0 + maj;
+    }
+    for(int i = 0; i < 8; ++i) self->state[i] += v[i];
+}
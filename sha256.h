@@ -0,0 +1,44 @@
+#ifndef STM32SPROG_SHA256_H
+#define STM32SPROG_SHA256_H
+/** \file sha256.h
+ *
+ * SHA-256 (FIPS 180-4), used to recognize firmware files by their contents.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Size of a digest in bytes. */
+#define SHA256_DIGEST_SIZE 32
+
+/** State of a digest being computed. */
+typedef struct {
+    uint32_t state[8];
+    /** Bytes hashed so far. */
+    uint64_t length;
+    /** Input not yet hashed, less than one block. */
+    uint8_t block[64];
+} Sha256;
+
+/** \brief Start a digest.
+ *
+ * \param self The digest state.
+ */
+void Sha256_init(Sha256 *self);
+
+/** \brief Add data to a digest.
+ *
+ * \param self The digest state.
+ * \param data The data.
+ * \param length The length of the data in bytes.
+ */
+void Sha256_update(Sha256 *self, const void *data, size_t length);
+
+/** \brief Finish a digest.
+ *
+ * \param self The digest state, which must be started again for reuse.
+ * \param digest Receives the digest.
+ */
+void Sha256_final(Sha256 *self, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif /* STM32SPROG_SHA256_H */
@@ -0,0 +1,483 @@
+#include "simulator.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "protocol.h"
+
+static const uint16_t DEFAULT_ID = ID_MED_DENSITY;
+static const useconds_t DEFAULT_ERASE_LATENCY = 20000;
+static const useconds_t DEFAULT_WRITE_LATENCY = 5000;
+
+static const size_t MAX_BLOCK_SIZE = 256;
+
+/** Bits per byte on the wire: start bit, 8 data bits, parity and stop bit. */
+static const int BITS_PER_BYTE = 11;
+
+/** A response waiting for its turnaround delay to pass. */
+typedef struct Response Response;
+struct Response {
+    Response *next;
+    uint64_t due;
+    size_t length;
+    uint8_t data[];
+};
+
+/** The simulated target. */
+struct SSimulator {
+    SimConfig config;
+    uint8_t bootloaderVer;
+    /** The flash layout. */
+    DeviceInfo layout;
+    uint32_t flashBeginAddr;
+    size_t flashSize;
+    /** The flash contents. */
+    uint8_t *flash;
+    SimStats stats;
+    /** The connection being served. */
+    int fd;
+    /** Responses delayed by the turnaround latency, oldest first. */
+    Response *responses;
+    Response **responsesEnd;
+};
+
+static void wireDelay(Simulator *sim, size_t n);
+static uint64_t monotonicUsec(void);
+static bool writeAll(Simulator *sim, const uint8_t *buffer, size_t n);
+static bool sendDue(Simulator *sim, int *timeout);
+static bool simRead(Simulator *sim, uint8_t *buffer, size_t n);
+static bool simWrite(Simulator *sim, const uint8_t *buffer, size_t n);
+static bool simSendByte(Simulator *sim, uint8_t byte);
+static bool simRecvAddr(Simulator *sim, uint32_t *addr);
+static bool inFlash(Simulator *sim, uint32_t addr, size_t size);
+static void erasePage(Simulator *sim, uint16_t page);
+static void eraseAll(Simulator *sim);
+
+static bool handleGet(Simulator *sim);
+static bool handleGetId(Simulator *sim);
+static bool handleReadMem(Simulator *sim);
+static bool handleGo(Simulator *sim);
+static bool handleWriteMem(Simulator *sim);
+static bool handleErase(Simulator *sim);
+static bool handleExtendedErase(Simulator *sim);
+
+void Simulator_defaultConfig(SimConfig *config) {
+    assert(config);
+
+    memset(config, 0, sizeof(*config));
+    config->id = DEFAULT_ID;
+    config->eraseLatency = DEFAULT_ERASE_LATENCY;
+    config->writeLatency = DEFAULT_WRITE_LATENCY;
+}
+
+Simulator *Simulator_create(const SimConfig *config) {
+    assert(config);
+
+    const DeviceInfo *info = stmFindDevice(config->id);
+    if(!info) {
+        stmSetError(STM_ERROR_UNSUPPORTED, "device ID 0x%x is unknown",
+                config->id);
+        return NULL;
+    }
+
+    Simulator *sim = calloc(1, sizeof(Simulator));
+    if(!sim) abort();
+
+    sim->config = *config;
+    sim->bootloaderVer = config->extendedErase ? 0x31 : 0x22;
+    sim->layout = *info;
+    if(config->flashSize > 0 || config->pageSize > 0) {
+        /* Overrides describe uniform pages. */
+        if(config->flashSize > 0) {
+            sim->layout.flashEndAddr = info->flashBeginAddr +
+                    config->flashSize;
+        }
+        if(config->pageSize > 0) sim->layout.flashPageSize = config->pageSize;
+        sim->layout.sectors = NULL;
+    }
+    sim->flashBeginAddr = sim->layout.flashBeginAddr;
+    sim->flashSize = sim->layout.flashEndAddr - sim->flashBeginAddr;
+    if(sim->flashSize % sim->layout.flashPageSize) {
+        stmSetError(STM_ERROR_RANGE,
+                "flash size must be a multiple of the page size");
+        goto ConfigError;
+    }
+
+    sim->flash = malloc(sim->flashSize);
+    if(!sim->flash) goto ConfigError;
+    memset(sim->flash, sim->layout.erasedValue, sim->flashSize);
+
+    sim->fd = -1;
+    sim->responses = NULL;
+    sim->responsesEnd = &sim->responses;
+    return sim;
+
+ConfigError:
+    free(sim);
+    return NULL;
+}
+
+void Simulator_destroy(Simulator *sim) {
+    if(!sim) return;
+
+    free(sim->flash);
+    free(sim);
+}
+
+void Simulator_run(Simulator *sim, int fd) {
+    assert(sim);
+
+    sim->fd = fd;
+
+    uint8_t cmd[2];
+    bool ok = true;
+    while(ok && simRead(sim, cmd, 1)) {
+        if(cmd[0] == SYNC_BYTE) {
+            /* Treat every sync byte as a target reset, so that consecutive
+             * client sessions work without DTR. */
+            if(sim->config.trace) fprintf(sim->config.trace, "sync\n");
+            ok = simSendByte(sim, ACK);
+            continue;
+        }
+        if(!simRead(sim, cmd + 1, 1)) break;
+        sim->stats.commands++;
+        if((cmd[0] ^ cmd[1]) != 0xFF) {
+            ok = simSendByte(sim, NACK);
+            continue;
+        }
+        if(sim->config.trace) {
+            fprintf(sim->config.trace, "command 0x%02x\n", cmd[0]);
+        }
+
+        switch(cmd[0]) {
+        case CMD_GET_VERSION:    ok = handleGet(sim);        break;
+        case CMD_GET_ID:         ok = handleGetId(sim);      break;
+        case CMD_READ_MEM:       ok = handleReadMem(sim);    break;
+        case CMD_GO:             ok = handleGo(sim);         break;
+        case CMD_WRITE_MEM:      ok = handleWriteMem(sim);   break;
+        case CMD_ERASE:
+            ok = sim->config.extendedErase ? simSendByte(sim, NACK) :
+                    handleErase(sim);
+            break;
+        case CMD_EXTENDED_ERASE:
+            ok = sim->config.extendedErase ? handleExtendedErase(sim) :
+                    simSendByte(sim, NACK);
+            break;
+        default:                 ok = simSendByte(sim, NACK); break;
+        }
+    }
+
+    while(sim->responses) {
+        Response *next = sim->responses->next;
+        free(sim->responses);
+        sim->responses = next;
+    }
+    sim->responsesEnd = &sim->responses;
+    sim->fd = -1;
+}
+
+const DeviceInfo *Simulator_layout(const Simulator *sim) {
+    assert(sim);
+
+    return &sim->layout;
+}
+
+SimStats Simulator_stats(const Simulator *sim) {
+    assert(sim);
+
+    return sim->stats;
+}
+
+static void wireDelay(Simulator *sim, size_t n) {
+    if(sim->config.baud > 0) {
+        usleep((uint64_t)n * BITS_PER_BYTE * 1000000 / sim->config.baud);
+    }
+}
+
+static uint64_t monotonicUsec(void) {
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool writeAll(Simulator *sim, const uint8_t *buffer, size_t n) {
+    while(n) {
+        ssize_t result = write(sim->fd, buffer, n);
+        if(result < 0 && errno == EAGAIN) {
+            struct pollfd pfd = { .fd = sim->fd, .events = POLLOUT };
+            (void)poll(&pfd, 1, -1);
+            continue;
+        }
+        if(result <= 0) return false;
+        buffer += result;
+        n -= result;
+    }
+    return true;
+}
+
+static bool sendDue(Simulator *sim, int *timeout) {
+    uint64_t now = monotonicUsec();
+    while(sim->responses && sim->responses->due <= now) {
+        Response *response = sim->responses;
+        sim->responses = response->next;
+        if(!sim->responses) sim->responsesEnd = &sim->responses;
+        bool ok = writeAll(sim, response->data, response->length);
+        free(response);
+        if(!ok) return false;
+    }
+    /* Round up, so that poll() does not wake up early and spin. */
+    *timeout = sim->responses ?
+            (int)((sim->responses->due - now + 999) / 1000) : -1;
+    return true;
+}
+
+static bool simRead(Simulator *sim, uint8_t *buffer, size_t n) {
+    size_t total = n;
+    while(n) {
+        int timeout;
+        if(!sendDue(sim, &timeout)) return false;
+        struct pollfd pfd = { .fd = sim->fd, .events = POLLIN, .revents = 0 };
+        int ready = poll(&pfd, 1, timeout);
+        if(ready < 0) return false;
+        if(ready == 0) continue;
+        ssize_t result = read(sim->fd, buffer, n);
+        if(result < 0 && errno == EAGAIN) continue;
+        if(result <= 0) return false;
+        buffer += result;
+        n -= result;
+    }
+    wireDelay(sim, total);
+    return true;
+}
+
+static bool simWrite(Simulator *sim, const uint8_t *buffer, size_t n) {
+    wireDelay(sim, n);
+    if(!sim->config.turnaround) return writeAll(sim, buffer, n);
+
+    Response *response = malloc(sizeof(Response) + n);
+    if(!response) return false;
+    response->next = NULL;
+    response->due = monotonicUsec() + sim->config.turnaround;
+    response->length = n;
+    memcpy(response->data, buffer, n);
+    *sim->responsesEnd = response;
+    sim->responsesEnd = &response->next;
+    return true;
+}
+
+static bool simSendByte(Simulator *sim, uint8_t byte) {
+    if(byte == NACK) sim->stats.nacks++;
+    return simWrite(sim, &byte, 1);
+}
+
+static bool simRecvAddr(Simulator *sim, uint32_t *addr) {
+    uint8_t buffer[5];
+    if(!simRead(sim, buffer, sizeof(buffer))) return false;
+    uint8_t checksum = 0;
+    *addr = 0;
+    for(int i = 0; i < 4; ++i) {
+        *addr = (*addr << CHAR_BIT) | buffer[i];
+        checksum ^= buffer[i];
+    }
+    if(checksum != buffer[4]) {
+        *addr = UINT32_MAX;
+    }
+    return true;
+}
+
+static bool inFlash(Simulator *sim, uint32_t addr, size_t size) {
+    return addr >= sim->flashBeginAddr &&
+            addr - sim->flashBeginAddr + size <= sim->flashSize;
+}
+
+static void erasePage(Simulator *sim, uint16_t page) {
+    if((size_t)page >= stmDevicePageCount(&sim->layout)) {
+        usleep(sim->config.eraseLatency);
+        return;
+    }
+
+    uint32_t begin = stmDevicePageAddr(&sim->layout, page);
+    size_t size = stmDevicePageAddr(&sim->layout, page + 1) - begin;
+    memset(sim->flash + (begin - sim->flashBeginAddr),
+            sim->layout.erasedValue, size);
+    sim->stats.pagesErased++;
+    usleep((uint64_t)sim->config.eraseLatency * size /
+            sim->layout.flashPageSize);
+}
+
+static void eraseAll(Simulator *sim) {
+    for(size_t page = 0; page < stmDevicePageCount(&sim->layout); ++page) {
+        erasePage(sim, page);
+    }
+}
+
+static bool handleGet(Simulator *sim) {
+    uint8_t buffer[] = {
+        ACK,
+        0,
+        sim->bootloaderVer,
+        CMD_GET_VERSION,
+        CMD_GET_ID,
+        CMD_READ_MEM,
+        CMD_GO,
+        CMD_WRITE_MEM,
+        sim->config.extendedErase ? CMD_EXTENDED_ERASE : CMD_ERASE,
+        ACK
+    };
+    /* Number of bytes following the count, minus one. */
+    buffer[1] = sizeof(buffer) - 4;
+    return simWrite(sim, buffer, sizeof(buffer));
+}
+
+static bool handleGetId(Simulator *sim) {
+    uint16_t id = sim->config.id;
+    uint8_t buffer[] = {
+        ACK, 1, (uint8_t)(id >> CHAR_BIT), (uint8_t)id, ACK
+    };
+    return simWrite(sim, buffer, sizeof(buffer));
+}
+
+static bool handleReadMem(Simulator *sim) {
+    uint32_t addr;
+    uint8_t buffer[MAX_BLOCK_SIZE];
+
+    if(!simSendByte(sim, ACK)) return false;
+    if(!simRecvAddr(sim, &addr)) return false;
+    if(addr == UINT32_MAX || !inFlash(sim, addr, 1)) {
+        return simSendByte(sim, NACK);
+    }
+    if(!simSendByte(sim, ACK)) return false;
+    if(!simRead(sim, buffer, 2)) return false;
+    size_t size = (size_t)buffer[0] + 1;
+    if((buffer[0] ^ buffer[1]) != 0xFF || !inFlash(sim, addr, size)) {
+        return simSendByte(sim, NACK);
+    }
+    if(!simSendByte(sim, ACK)) return false;
+
+    sim->stats.bytesRead += size;
+    return simWrite(sim, sim->flash + (addr - sim->flashBeginAddr), size);
+}
+
+static bool handleGo(Simulator *sim) {
+    uint32_t addr;
+
+    if(!simSendByte(sim, ACK)) return false;
+    if(!simRecvAddr(sim, &addr)) return false;
+    if(addr == UINT32_MAX || !inFlash(sim, addr, 1)) {
+        return simSendByte(sim, NACK);
+    }
+    if(sim->config.events) {
+        fprintf(sim->config.events, "GO 0x%08x\n", addr);
+        fflush(sim->config.events);
+    }
+    return simSendByte(sim, ACK);
+}
+
+static bool handleWriteMem(Simulator *sim) {
+    uint32_t addr;
+    uint8_t buffer[MAX_BLOCK_SIZE + 1];
+
+    if(!simSendByte(sim, ACK)) return false;
+    if(!simRecvAddr(sim, &addr)) return false;
+    if(addr == UINT32_MAX || addr % 4 || !inFlash(sim, addr, 1)) {
+        return simSendByte(sim, NACK);
+    }
+    if(!simSendByte(sim, ACK)) return false;
+    if(!simRead(sim, buffer, 1)) return false;
+    size_t size = (size_t)buffer[0] + 1;
+    uint8_t checksum = buffer[0];
+    if(!simRead(sim, buffer, size + 1)) return false;
+    for(size_t i = 0; i < size; ++i) checksum ^= buffer[i];
+    if(checksum != buffer[size] || size % 4 || !inFlash(sim, addr, size)) {
+        return simSendByte(sim, NACK);
+    }
+    if(sim->config.failEvery &&
+            ++sim->stats.writes % sim->config.failEvery == 0) {
+        return simSendByte(sim, NACK);
+    }
+
+    /* Flash can only move bits away from their erased value: clear them
+     * where flash erases to ones, set them where it erases to zeroes.
+     * Programming a location that has not been erased fails, as it does on
+     * the real hardware. */
+    uint8_t *mem = sim->flash + (addr - sim->flashBeginAddr);
+    bool erasesToOnes = sim->layout.erasedValue == 0xFF;
+    bool programError = false;
+    for(size_t i = 0; i < size; ++i) {
+        uint8_t programmed = erasesToOnes ? mem[i] & buffer[i]
+                : mem[i] | buffer[i];
+        if(programmed != buffer[i]) programError = true;
+        mem[i] = programmed;
+    }
+    usleep(sim->config.writeLatency);
+    sim->stats.bytesWritten += size;
+
+    return simSendByte(sim, programError ? NACK : ACK);
+}
+
+static bool handleErase(Simulator *sim) {
+    uint8_t buffer[UINT8_MAX + 2];
+
+    if(!simSendByte(sim, ACK)) return false;
+    if(!simRead(sim, buffer, 1)) return false;
+    if(buffer[0] == 0xFF) {
+        if(!simRead(sim, buffer + 1, 1)) return false;
+        if(buffer[1] != 0x00) return simSendByte(sim, NACK);
+        eraseAll(sim);
+        return simSendByte(sim, ACK);
+    }
+
+    size_t count = (size_t)buffer[0] + 1;
+    uint8_t checksum = buffer[0];
+    if(!simRead(sim, buffer, count + 1)) return false;
+    for(size_t i = 0; i < count; ++i) checksum ^= buffer[i];
+    if(checksum != buffer[count]) return simSendByte(sim, NACK);
+
+    for(size_t i = 0; i < count; ++i) erasePage(sim, buffer[i]);
+    return simSendByte(sim, ACK);
+}
+
+static bool handleExtendedErase(Simulator *sim) {
+    uint8_t buffer[2];
+    uint8_t checksum = 0;
+
+    if(!simSendByte(sim, ACK)) return false;
+    if(!simRead(sim, buffer, 2)) return false;
+    uint16_t n = (buffer[0] << CHAR_BIT) | buffer[1];
+    checksum = buffer[0] ^ buffer[1];
+    if(n >= 0xFFF0) {
+        /* Mass erase (0xFFFF) or bank erase (0xFFFE, 0xFFFD). */
+        if(!simRead(sim, buffer, 1)) return false;
+        if(buffer[0] != checksum) return simSendByte(sim, NACK);
+        eraseAll(sim);
+        return simSendByte(sim, ACK);
+    }
+
+    size_t count = (size_t)n + 1;
+    uint16_t *pages = malloc(count * sizeof(uint16_t));
+    if(!pages) return false;
+    for(size_t i = 0; i < count; ++i) {
+        if(!simRead(sim, buffer, 2)) {
+            free(pages);
+            return false;
+        }
+        pages[i] = (buffer[0] << CHAR_BIT) | buffer[1];
+        checksum ^= buffer[0] ^ buffer[1];
+    }
+    bool ok = simRead(sim, buffer, 1);
+    if(ok) {
+        if(buffer[0] == checksum) {
+            for(size_t i = 0; i < count; ++i) erasePage(sim, pages[i]);
+            ok = simSendByte(sim, ACK);
+        } else {
+            ok = simSendByte(sim, NACK);
+        }
+    }
+    free(pages);
+    return ok;
+}
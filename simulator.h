@@ -0,0 +1,110 @@
+#ifndef STM32SPROG_SIMULATOR_H
+#define STM32SPROG_SIMULATOR_H
+/** \file simulator.h
+ *
+ * Emulates the STM32 USART bootloader on a byte stream.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "devices.h"
+#include "error.h"
+
+/** Simulated bootloader handle. */
+typedef struct SSimulator Simulator;
+
+/** Parameters of a simulated target. */
+typedef struct {
+    /** The device ID reported by GET_ID. */
+    uint16_t id;
+    /** Use EXTENDED_ERASE (bootloader 3.1) instead of ERASE (2.2). */
+    bool extendedErase;
+    /** Override the flash size of the device, or 0 to keep it. */
+    long flashSize;
+    /** Override the page size of the device, or 0 to keep it.  Overriding
+     * either size makes all pages uniform. */
+    long pageSize;
+    /** Time to erase one page of the smallest size.  Larger sectors take
+     * proportionally longer. */
+    useconds_t eraseLatency;
+    /** Time to program one WRITE_MEM block. */
+    useconds_t writeLatency;
+    /** The emulated baud rate, or 0 to transfer at full speed. */
+    int baud;
+    /** Delay between a response being sent and the host seeing it, as added
+     * by USB-serial adapters.  Responses are delayed without stalling the
+     * simulated target. */
+    useconds_t turnaround;
+    /** Reject every n-th WRITE_MEM block, or never if 0. */
+    unsigned long failEvery;
+    /** Stream to log every command to, or NULL. */
+    FILE *trace;
+    /** Stream to report GO commands to, or NULL. */
+    FILE *events;
+} SimConfig;
+
+/** Counters of the work done by a simulator. */
+typedef struct {
+    unsigned long commands;
+    unsigned long nacks;
+    unsigned long writes;
+    unsigned long pagesErased;
+    unsigned long bytesWritten;
+    unsigned long bytesRead;
+} SimStats;
+
+/** \brief Fill in the default simulator parameters.
+ *
+ * The defaults describe a medium density device with bootloader 2.2 and
+ * typical erase and write latencies, transferring at full speed.
+ *
+ * \param config The parameters to initialize.
+ */
+void Simulator_defaultConfig(SimConfig *config);
+
+/** \brief Create a simulated target with erased flash.
+ *
+ * \param config The target parameters.
+ *
+ * \return A new \ref Simulator, or NULL if the parameters are invalid or
+ *         memory could not be allocated.
+ */
+Simulator *Simulator_create(const SimConfig *config);
+
+/** \brief Destroy a simulated target.  Frees its flash contents.
+ *
+ * \param sim A simulator.
+ */
+void Simulator_destroy(Simulator *sim);
+
+/** \brief Serve bootloader commands on a file descriptor.
+ *
+ * Returns when the peer closes the connection, a read or write fails, or a
+ * signal interrupts the wait for input.  The flash contents persist, so the
+ * simulator may serve several connections in turn.
+ *
+ * \param sim A simulator.
+ * \param fd A readable and writable file descriptor.
+ */
+void Simulator_run(Simulator *sim, int fd);
+
+/** \brief Get the flash layout of a simulated target.
+ *
+ * \param sim A simulator.
+ *
+ * \return The layout, after any size overrides.
+ */
+const DeviceInfo *Simulator_layout(const Simulator *sim);
+
+/** \brief Get the work counters of a simulated target.
+ *
+ * \param sim A simulator.
+ *
+ * \return The counters accumulated over all connections.
+ */
+SimStats Simulator_stats(const Simulator *sim);
+
+#endif /* STM32SPROG_SIMULATOR_H */
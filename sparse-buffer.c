@@ -4,276 +4,440 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
-#define MAX_HEIGHT 16
+/** Number of extents allocated for a new buffer. */
+#define INITIAL_EXTENTS 16
+/** Usual size of the chunks extent data is allocated from. */
+#define ARENA_CHUNK_SIZE 65536
 
-typedef struct Node Node;
-struct Node {
+/** A contiguous run of data. */
+typedef struct {
     MemBlock block;
+    /** Bytes allocated for the data if the extent owns it, or 0 if the data
+     * is borrowed from the caller. */
+    size_t capacity;
+} Extent;
+
+/** A chunk of memory that extent data is carved from. */
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size;
+    size_t used;
+    uint8_t data[];
+};
 
-    int height;
-    Node *prev[MAX_HEIGHT];
-    Node *next[MAX_HEIGHT];
+/** Allocates extent data by bumping a pointer, and frees it all at once.
+ * The last allocation in the current chunk may grow in place. */
+typedef struct {
+    /** The chunk allocations come from, followed by the full ones. */
+    ArenaChunk *chunks;
+} Arena;
+
+/** A memory mapping owned by a sparse buffer. */
+typedef struct Mapping Mapping;
+struct Mapping {
+    Mapping *next;
+    void *addr;
+    size_t length;
 };
 
+/* The extents are sorted by offset.  They neither overlap nor adjoin, since
+ * such extents are merged as they are set. */
 struct SparseBuffer {
-    Node *begin;
-    Node *curr;
-    size_t offset;
+    Extent *extents;
+    size_t count;
+    size_t capacity;
+    /** The total length of the extents. */
+    size_t size;
+    /** Holds the data of all owned extents. */
+    Arena arena;
+    Mapping *mappings;
+    /** The position of SparseBuffer_read(). */
+    SparseBufferCursor cursor;
 };
 
-/** \brief Create a copy of a data buffer.
- *
- * \param data The data to copy.
- * \param length The size of the data buffer in bytes.
- *
- * \return A copy of the given data.  The caller must free() this pointer.
- */
-static void *memdup(const void *data, size_t length);
-
-/** \brief Test whether two blocks can be merged into one contiguous block.
- *
- * \param block1 The first block.
- * \param block2 The second block.
- *
- * \return \c true if the blocks can be merged, \c false if there is a gap
- *         between them.
- */
-static bool overlap(MemBlock block1, MemBlock block2);
+static void setBlock(SparseBuffer *self, MemBlock block, bool copy);
+static size_t findFirst(const SparseBuffer *self, size_t offset);
+static void insertExtent(SparseBuffer *self, size_t index, MemBlock block,
+        bool copy);
+static void mergeExtents(SparseBuffer *self, size_t first, size_t last,
+        MemBlock block);
 
-static int randomHeight();
-static void insertNode(Node *node, Node *prev[MAX_HEIGHT]);
-static void removeNode(Node *node);
+static const Extent *cursorExtent(const SparseBuffer *self,
+        SparseBufferCursor *cursor);
+static size_t endOf(const Extent *extent);
+static void Extent_reserve(Extent *self, Arena *arena, size_t length);
 
-static Node *Node_create();
-static void Node_destroy(Node *self);
-static void Node_addData(Node *node, MemBlock block);
+static void *Arena_alloc(Arena *self, size_t size);
+static void *Arena_grow(Arena *self, void *data, size_t size,
+        size_t newSize);
+static void Arena_destroy(Arena *self);
 
 SparseBuffer *SparseBuffer_create() {
     SparseBuffer *self = malloc(sizeof(SparseBuffer));
     if(!self) abort();
 
-    self->begin = Node_create();
-    self->begin->height = MAX_HEIGHT;
+    self->extents = malloc(INITIAL_EXTENTS * sizeof(Extent));
+    if(!self->extents) abort();
+    self->count = 0;
+    self->capacity = INITIAL_EXTENTS;
+    self->size = 0;
+    self->arena.chunks = NULL;
+    self->mappings = NULL;
 
-    self->curr = self->begin;
-    self->offset = 0;
+    SparseBuffer_begin(self, &self->cursor);
 
     return self;
 }
 
 void SparseBuffer_destroy(SparseBuffer *self) {
-    Node *node = self->begin;
-    while(node != NULL) {
-        Node *next = node->next[0];
-        Node_destroy(node);
-        node = next;
+    Arena_destroy(&self->arena);
+    free(self->extents);
+    while(self->mappings) {
+        Mapping *next = self->mappings->next;
+        munmap(self->mappings->addr, self->mappings->length);
+        free(self->mappings);
+        self->mappings = next;
     }
     free(self);
 }
 
 void SparseBuffer_set(SparseBuffer *self, MemBlock block) {
-    Node *prev[MAX_HEIGHT];
-    Node *node = self->begin;
-    int level = MAX_HEIGHT - 1;
-
-    while(level >= 0) {
-        Node *next = node->next[level];
-        if(!next) {
-            prev[level] = node;
-            level--;
-        } else if(overlap(block, next->block)) {
-            Node_addData(next, block);
-            node = next->next[0];
-            if(node && overlap(node->block, next->block)) {
-                Node_addData(next, node->block);
-                removeNode(node);
-            }
-            return;
-        } else if(block.offset > next->block.offset) {
-            node = node->next[level];
-        } else {
-            prev[level] = node;
-            level--;
-        }
-    }
+    setBlock(self, block, true);
+}
 
-    node = Node_create();
-    Node_addData(node, block);
-    insertNode(node, prev);
+void SparseBuffer_borrow(SparseBuffer *self, MemBlock block) {
+    setBlock(self, block, false);
+}
+
+void SparseBuffer_addMapping(SparseBuffer *self, void *addr, size_t length) {
+    Mapping *mapping = malloc(sizeof(Mapping));
+    if(!mapping) abort();
+    mapping->addr = addr;
+    mapping->length = length;
+    mapping->next = self->mappings;
+    self->mappings = mapping;
 }
 
 void SparseBuffer_offset(SparseBuffer *self, ptrdiff_t offset) {
-    Node *node = self->begin;
-    while(node) {
-        node->block.offset += offset;
-        node = node->next[0];
+    for(size_t i = 0; i < self->count; ++i) {
+        self->extents[i].block.offset += offset;
     }
-    self->offset += offset;
+    self->cursor.offset += offset;
 }
 
 MemBlock SparseBuffer_read(SparseBuffer *self, size_t length) {
-    MemBlock result;
-
-    Node *node = self->curr;
-    size_t offset = self->offset;
-    size_t end = node->block.offset + node->block.length;
-    if(offset >= end) {
-        node = node->next[0];
-        if(!node) {
-            result.offset = 0;
-            result.length = 0;
-            result.data = NULL;
-            return result;
-        }
-        offset = node->block.offset;
-        end = offset + node->block.length;
-    }
+    return SparseBuffer_next(self, &self->cursor, length);
+}
+
+void SparseBuffer_begin(const SparseBuffer *self, SparseBufferCursor *cursor) {
+    cursor->index = 0;
+    cursor->offset = self->count ? self->extents[0].block.offset : 0;
+}
 
+MemBlock SparseBuffer_next(const SparseBuffer *self, SparseBufferCursor *cursor,
+        size_t length) {
+    MemBlock result = { 0, 0, NULL };
+
+    const Extent *extent = cursorExtent(self, cursor);
+    if(!extent) return result;
+    size_t offset = cursor->offset;
+
+    size_t end = endOf(extent);
     if(!length || offset + length > end) {
         length = end - offset;
     }
 
-    size_t diff = offset - node->block.offset;
     result.offset = offset;
     result.length = length;
-    result.data = node->block.data + diff;
+    result.data = extent->block.data + (offset - extent->block.offset);
 
-    self->curr = node;
-    self->offset = offset + length;
+    cursor->offset = offset + length;
 
     return result;
 }
 
-size_t SparseBuffer_size(SparseBuffer *self) {
-    size_t size = 0;
-    Node *node = self->begin;
-    while(node) {
-        size += node->block.length;
-        node = node->next[0];
+MemBlock SparseBuffer_nextBefore(const SparseBuffer *self,
+        SparseBufferCursor *cursor, size_t end) {
+    MemBlock result = { 0, 0, NULL };
+
+    const Extent *extent = cursorExtent(self, cursor);
+    if(!extent || cursor->offset >= end) return result;
+
+    if(endOf(extent) < end) end = endOf(extent);
+    return SparseBuffer_next(self, cursor, end - cursor->offset);
+}
+
+MemBlock SparseBuffer_nextAligned(const SparseBuffer *self,
+        SparseBufferCursor *cursor, size_t size, size_t granule,
+        uint8_t fill, uint8_t *scratch, size_t *dataLength) {
+    MemBlock result = { 0, 0, NULL };
+    *dataLength = 0;
+
+    if(!cursorExtent(self, cursor)) return result;
+    size_t windowEnd = cursor->offset - cursor->offset % size + size;
+    size_t begin = cursor->offset - cursor->offset % granule;
+
+    MemBlock block = SparseBuffer_nextBefore(self, cursor, windowEnd);
+    size_t end = block.offset + block.length;
+    *dataLength = block.length;
+
+    /* Most windows are covered by a single extent, and need no copy. */
+    SparseBufferCursor next = *cursor;
+    bool alone = !cursorExtent(self, &next) || next.offset >= windowEnd;
+    if(alone && begin == block.offset && end % granule == 0) return block;
+
+    memset(scratch, fill, size);
+    for(;;) {
+        memcpy(scratch + (block.offset - begin), block.data, block.length);
+        end = block.offset + block.length;
+        block = SparseBuffer_nextBefore(self, cursor, windowEnd);
+        if(!block.data) break;
+        *dataLength += block.length;
     }
-    return size;
+    if(end % granule) end += granule - end % granule;
+
+    result.offset = begin;
+    result.length = end - begin;
+    result.data = scratch;
+    return result;
 }
 
-void SparseBuffer_rewind(SparseBuffer *self) {
-    self->curr = self->begin;
-    self->offset = self->curr ? self->curr->block.offset : 0;
+size_t SparseBuffer_size(const SparseBuffer *self) {
+    return self->size;
 }
 
-static void *memdup(const void *data, size_t length) {
-    void *copy = malloc(length);
-    if(!copy) abort();
-    return memcpy(copy, data, length);
+size_t SparseBuffer_extentCount(const SparseBuffer *self) {
+    return self->count;
 }
 
-static bool overlap(MemBlock block1, MemBlock block2) {
-    size_t end1 = block1.offset + block1.length;
-    size_t end2 = block2.offset + block2.length;
-    return ((block2.offset <= block1.offset) && (block1.offset <= end2)) ||
-            ((block2.offset <= end1) && (end1 <= end2)) ||
-            ((block1.offset <= block2.offset) && (block2.offset <= end1)) ||
-            ((block1.offset <= end2) && (end2 <= end1));
+bool SparseBuffer_bounds(const SparseBuffer *self, size_t *begin,
+        size_t *end) {
+    if(!self->count) return false;
+    *begin = self->extents[0].block.offset;
+    *end = endOf(&self->extents[self->count - 1]);
+    return true;
+}
+
+void SparseBuffer_rewind(SparseBuffer *self) {
+    SparseBuffer_begin(self, &self->cursor);
 }
 
-static int randomHeight() {
-    int r = rand();
-    int pivot = (RAND_MAX / 2) + 1;
-    int height = 1;
+static void setBlock(SparseBuffer *self, MemBlock block, bool copy) {
+    if(!block.length) return;
 
-    while(r < pivot && height < MAX_HEIGHT) {
-        height++;
-        pivot /= 2;
+    /* Parsers mostly produce data in ascending order, so try the end
+     * first. */
+    size_t first;
+    if(!self->count || block.offset > endOf(&self->extents[self->count - 1])) {
+        first = self->count;
+    } else if(block.offset >= self->extents[self->count - 1].block.offset) {
+        first = self->count - 1;
+    } else {
+        first = findFirst(self, block.offset);
     }
 
-    return height;
-}
+    size_t end = block.offset + block.length;
+    size_t last = first;
+    while(last < self->count && self->extents[last].block.offset <= end) {
+        last++;
+    }
 
-static void insertNode(Node *node, Node *prev[MAX_HEIGHT]) {
-    for(int i = 0; i < node->height; ++i) {
-        Node *p = prev[i];
-        Node *n = p->next[i];
+    if(last == first) {
+        insertExtent(self, first, block, copy);
+    } else {
+        mergeExtents(self, first, last - 1, block);
+    }
 
-        node->prev[i] = p;
-        node->next[i] = n;
-        p->next[i] = node;
-        if(n) n->prev[i] = node;
+    /* Only the new extent can have broken the order. */
+    assert(first == 0 || endOf(&self->extents[first - 1])
+            < self->extents[first].block.offset);
+    assert(first + 1 == self->count || endOf(&self->extents[first])
+            < self->extents[first + 1].block.offset);
+}
+
+/** \brief Find the first extent that ends at or after an offset.
+ *
+ * \return The index of the extent, or the number of extents if there is
+ *         none.
+ */
+static size_t findFirst(const SparseBuffer *self, size_t offset) {
+    size_t low = 0;
+    size_t high = self->count;
+    while(low < high) {
+        size_t mid = low + (high - low) / 2;
+        if(endOf(&self->extents[mid]) < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
+    return low;
 }
 
-static void removeNode(Node *node) {
-    for(int i = 0; i < node->height; ++i) {
-        Node *p = node->prev[i];
-        Node *n = node->next[i];
-        p->next[i] = n;
-        if(n) n->prev[i] = p;
+static void insertExtent(SparseBuffer *self, size_t index, MemBlock block,
+        bool copy) {
+    if(self->count == self->capacity) {
+        self->capacity *= 2;
+        self->extents = realloc(self->extents,
+                self->capacity * sizeof(Extent));
+        if(!self->extents) abort();
+    }
+    memmove(&self->extents[index + 1], &self->extents[index],
+            (self->count - index) * sizeof(Extent));
+    self->count++;
+    self->size += block.length;
+
+    Extent *extent = &self->extents[index];
+    extent->block = block;
+    extent->capacity = 0;
+    if(copy) {
+        extent->block.length = 0;
+        Extent_reserve(extent, &self->arena, block.length);
+        memcpy((uint8_t *)extent->block.data, block.data, block.length);
+        extent->block.length = block.length;
     }
-    free(node);
 }
 
-static Node *Node_create() {
-    Node *self = malloc(sizeof(Node));
-    if(!self) abort();
+/** \brief Merge a block with the extents it overlaps or adjoins.
+ *
+ * The block's data takes precedence over the data of the extents.
+ */
+static void mergeExtents(SparseBuffer *self, size_t first, size_t last,
+        MemBlock block) {
+    Extent *extent = &self->extents[first];
+    size_t begin = block.offset;
+    size_t end = block.offset + block.length;
+    if(extent->block.offset < begin) begin = extent->block.offset;
+    if(endOf(&self->extents[last]) > end) end = endOf(&self->extents[last]);
+    self->size += (end - begin) - extent->block.length;
+
+    /* Grow the first extent in place if the merged run starts with it;
+     * this is the common case of data appended to an extent. */
+    if(extent->block.offset != begin) {
+        Extent merged = { { begin, 0, NULL }, 0 };
+        Extent_reserve(&merged, &self->arena, end - begin);
+        memcpy((uint8_t *)merged.block.data + (extent->block.offset - begin),
+                extent->block.data, extent->block.length);
+        *extent = merged;
+    }
+    Extent_reserve(extent, &self->arena, end - begin);
+    uint8_t *data = (uint8_t *)extent->block.data;
+
+    for(size_t i = first + 1; i <= last; ++i) {
+        Extent *other = &self->extents[i];
+        self->size -= other->block.length;
+        /* Extents covered by the block are overwritten anyway. */
+        if(other->block.offset < block.offset
+                || endOf(other) > block.offset + block.length) {
+            memcpy(data + (other->block.offset - begin), other->block.data,
+                    other->block.length);
+        }
+    }
+    memcpy(data + (block.offset - begin), block.data, block.length);
+    extent->block.length = end - begin;
 
-    self->block.offset = 0;
-    self->block.length = 0;
-    self->block.data = NULL;
+    memmove(&self->extents[first + 1], &self->extents[last + 1],
+            (self->count - last - 1) * sizeof(Extent));
+    self->count -= last - first;
+}
 
-    self->height = randomHeight();
-    for(int i = 0; i < MAX_HEIGHT; ++i) {
-        self->prev[i] = NULL;
-        self->next[i] = NULL;
+/** \brief Move a cursor past the end of its extent to the next one.
+ *
+ * \return The extent holding the data at the cursor, or NULL at the end of
+ *         the buffer.
+ */
+static const Extent *cursorExtent(const SparseBuffer *self,
+        SparseBufferCursor *cursor) {
+    if(cursor->index >= self->count) return NULL;
+    const Extent *extent = &self->extents[cursor->index];
+    if(cursor->offset >= endOf(extent)) {
+        if(++cursor->index >= self->count) return NULL;
+        extent = &self->extents[cursor->index];
+        cursor->offset = extent->block.offset;
     }
+    return extent;
+}
 
-    return self;
+static size_t endOf(const Extent *extent) {
+    return extent->block.offset + extent->block.length;
 }
 
-static void Node_destroy(Node *self) {
-    /* const-cast */
-    uint8_t *nodeData = (uint8_t *)self->block.data;
+/** \brief Make an extent own room for at least \a length bytes of data.
+ *
+ * The current data is kept.  Owned data grows geometrically, so that
+ * appending to an extent takes amortized constant time per byte.
+ */
+static void Extent_reserve(Extent *self, Arena *arena, size_t length) {
+    if(self->capacity >= length) return;
 
-    free(nodeData);
-    free(self);
-}
+    size_t capacity = self->capacity * 2;
+    if(capacity < length) capacity = length;
 
-static void Node_addData(Node *self, MemBlock block) {
-    if(!self->block.data) {
-        self->block.offset = block.offset;
-        self->block.length = block.length;
-        self->block.data = memdup(block.data, block.length);
-        return;
+    /* const-cast */
+    uint8_t *data = (uint8_t *)self->block.data;
+    if(self->capacity) {
+        data = Arena_grow(arena, data, self->capacity, capacity);
+    } else {
+        data = Arena_alloc(arena, capacity);
+        if(self->block.length) {
+            memcpy(data, self->block.data, self->block.length);
+        }
     }
+    self->block.data = data;
+    self->capacity = capacity;
+}
 
-    assert(overlap(block, self->block));
-
-    size_t end = block.offset + block.length;
-    size_t nodeEnd = self->block.offset + self->block.length;
+static void *Arena_alloc(Arena *self, size_t size) {
+    ArenaChunk *chunk = self->chunks;
+    if(!chunk || chunk->size - chunk->used < size) {
+        size_t chunkSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(ArenaChunk) + chunkSize);
+        if(!chunk) abort();
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        chunk->next = self->chunks;
+        self->chunks = chunk;
+    }
 
-    /* const-cast */
-    uint8_t *nodeData = (uint8_t *)self->block.data;
+    void *data = chunk->data + chunk->used;
+    chunk->used += size;
+    return data;
+}
 
-    if(block.offset >= self->block.offset) {
-        if(end > nodeEnd) {
-            self->block.length = end - self->block.offset;
-            nodeData = realloc(nodeData, self->block.length);
-            if(!nodeData) abort();
+/** \brief Resize an allocation, in place if it is the last one made. */
+static void *Arena_grow(Arena *self, void *data, size_t size,
+        size_t newSize) {
+    ArenaChunk *chunk = self->chunks;
+    if(chunk && (uint8_t *)data + size == chunk->data + chunk->used) {
+        if(chunk->size - chunk->used >= newSize - size) {
+            chunk->used += newSize - size;
+            return data;
         }
-        size_t diff = block.offset - self->block.offset;
-        memcpy(nodeData + diff, block.data, block.length);
-    } else {
-        size_t nTotal = (end >= nodeEnd) ?
-                block.length : nodeEnd - block.offset;
-        nodeData = realloc(nodeData, nTotal);
-        if(!nodeData) abort();
-        if(end < nodeEnd) {
-            // TODO: Avoid copying data that will be overwritten anyway.
-            size_t diff = self->block.offset - block.offset;
-            memmove(nodeData + diff, self->block.data, self->block.length);
+        /* A chunk holding nothing else can be resized, which lets large
+         * extents grow without copying on most platforms. */
+        if(data == chunk->data) {
+            chunk = realloc(chunk, sizeof(ArenaChunk) + newSize);
+            if(!chunk) abort();
+            chunk->size = newSize;
+            chunk->used = newSize;
+            self->chunks = chunk;
+            return chunk->data;
         }
-        memcpy(nodeData, block.data, block.length);
-        self->block.offset = block.offset;
-        self->block.length = nTotal;
     }
 
-    block.data = nodeData;
+    /* The old space is reclaimed with the arena. */
+    void *copy = Arena_alloc(self, newSize);
+    memcpy(copy, data, size);
+    return copy;
 }
 
+static void Arena_destroy(Arena *self) {
+    while(self->chunks) {
+        ArenaChunk *next = self->chunks->next;
+        free(self->chunks);
+        self->chunks = next;
+    }
+}
@@ -2,6 +2,7 @@
 #define STM32SPROG_SPARSE_BUFFER_H
 /** \file sparse-buffer.h */
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -24,6 +25,19 @@ struct MemBlock {
     const uint8_t *data;
 };
 
+/** \brief A read position in a sparse buffer.
+ *
+ * Any number of cursors may read the same buffer concurrently, as long as the
+ * buffer is not modified meanwhile.
+ */
+typedef struct SparseBufferCursor SparseBufferCursor;
+struct SparseBufferCursor {
+    /** The index of the contiguous block being read. */
+    size_t index;
+    /** The offset of the next byte to read. */
+    size_t offset;
+};
+
 /** \brief Sparse buffer constructor.
  *
  * \return A new sparse buffer object, which must be freed by
@@ -47,6 +61,28 @@ void SparseBuffer_destroy(SparseBuffer *self);
  */
 void SparseBuffer_set(SparseBuffer *self, MemBlock block);
 
+/** \brief Sets data in a sparse buffer without copying it.
+ *
+ * Like SparseBuffer_set(), but the buffer refers to the block's data, which
+ * must stay valid and unchanged until the buffer is destroyed.  The data is
+ * only copied if the block overlaps or adjoins data already in the buffer.
+ *
+ * \param self The sparse buffer.
+ * \param block The block to store in the buffer.
+ */
+void SparseBuffer_borrow(SparseBuffer *self, MemBlock block);
+
+/** \brief Hand a memory mapping over to a sparse buffer.
+ *
+ * The mapping is removed with munmap() when the buffer is destroyed, so
+ * blocks borrowed from it stay valid as long as the buffer.
+ *
+ * \param self The sparse buffer.
+ * \param addr The start of the mapping.
+ * \param length The length of the mapping in bytes.
+ */
+void SparseBuffer_addMapping(SparseBuffer *self, void *addr, size_t length);
+
 /** \brief Add an offset to the position of the data in the buffer.
  *
  * \param self The sparse buffer.
@@ -64,13 +100,93 @@ void SparseBuffer_offset(SparseBuffer *self, ptrdiff_t offset);
  */
 MemBlock SparseBuffer_read(SparseBuffer *self, size_t length);
 
-/** \brief Get the number of bytes stored in the buffer.
+/** \brief Place a cursor at the beginning of a sparse buffer.
+ *
+ * \param self The sparse buffer.
+ * \param cursor The cursor to initialize.
+ */
+void SparseBuffer_begin(const SparseBuffer *self, SparseBufferCursor *cursor);
+
+/** \brief Reads data at a cursor, advancing the cursor.
+ *
+ * Like SparseBuffer_read(), but leaves the buffer's own read position alone.
+ *
+ * \param self The sparse buffer.
+ * \param cursor The read position.
+ * \param length The maximum number of bytes to read.  If 0, the rest of the
+ *               contiguous block will be read.
+ *
+ * \return The data, or a block with NULL data at the end of the buffer.
+ */
+MemBlock SparseBuffer_next(const SparseBuffer *self, SparseBufferCursor *cursor,
+        size_t length);
+
+/** \brief Reads data at a cursor, stopping before an offset.
+ *
+ * \param self The sparse buffer.
+ * \param cursor The read position.
+ * \param end The offset to stop at.
+ *
+ * \return The rest of the contiguous block, up to \a end, or a block with
+ *         NULL data if the buffer holds no more data before \a end.  The
+ *         cursor is only advanced past data that is returned.
+ */
+MemBlock SparseBuffer_nextBefore(const SparseBuffer *self,
+        SparseBufferCursor *cursor, size_t end);
+
+/** \brief Reads the data at a cursor in aligned windows, advancing the
+ *         cursor.
+ *
+ * The buffer is divided into windows of \a size bytes starting at multiples
+ * of \a size, and the windows holding data are returned in order.  Each
+ * block spans the data in its window, extended to multiples of \a granule,
+ * with any gaps set to \a fill.  Flash can thus be programmed with one
+ * aligned transaction per window.
+ *
+ * \param self The sparse buffer.
+ * \param cursor The read position.
+ * \param size The size of the windows.
+ * \param granule The alignment of the blocks.  Must divide \a size.
+ * \param fill The value of bytes that are not set.
+ * \param scratch Space of \a size bytes for blocks that have to be
+ *                assembled.  The block may point into it, so it must not be
+ *                reused while the block is in use.
+ * \param[out] dataLength The number of bytes of the block that are set in
+ *                        the buffer.
+ *
+ * \return The data, or a block with NULL data at the end of the buffer.
+ */
+MemBlock SparseBuffer_nextAligned(const SparseBuffer *self,
+        SparseBufferCursor *cursor, size_t size, size_t granule,
+        uint8_t fill, uint8_t *scratch, size_t *dataLength);
+
+/** \brief Get the number of bytes stored in the buffer in constant time.
  *
  * \param self The sparse buffer.
  *
  * \return The number of bytes in the buffer, excluding unset gaps.
  */
-size_t SparseBuffer_size(SparseBuffer *self);
+size_t SparseBuffer_size(const SparseBuffer *self);
+
+/** \brief Get the number of contiguous blocks in the buffer.
+ *
+ * \param self The sparse buffer.
+ *
+ * \return The number of blocks SparseBuffer_read() returns when reading the
+ *         buffer with a length of 0.
+ */
+size_t SparseBuffer_extentCount(const SparseBuffer *self);
+
+/** \brief Get the range of offsets spanned by the data in the buffer.
+ *
+ * \param self The sparse buffer.
+ * \param[out] begin The offset of the first byte.
+ * \param[out] end The offset just past the last byte.
+ *
+ * \return \c true on success, \c false if the buffer is empty.
+ */
+bool SparseBuffer_bounds(const SparseBuffer *self, size_t *begin,
+        size_t *end);
 
 /** \brief Reset the read position to the beginning of the buffer.
  *
@@ -0,0 +1,955 @@
+#include "stm32.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+static const int MAX_RETRIES = 10;
+/** Upper bound on the learned write gap, the fixed pause that ACK pacing
+ * replaced. */
+static const useconds_t MAX_WRITE_GAP = 80000;
+/** Blocks accepted in a row after which the write gap is halved. */
+static const unsigned GAP_DECAY_BLOCKS = 8;
+
+/** Timeouts in milliseconds. */
+static const unsigned SYNC_TIMEOUT = 100;
+static const unsigned ACK_TIMEOUT = 1000;
+/** Erase time allowance per KiB, on top of ACK_TIMEOUT. */
+static const unsigned ERASE_TIMEOUT_PER_KB = 40;
+
+static const size_t MAX_BLOCK_SIZE = 256;
+/** Largest page count that fits in one ERASE command. */
+static const size_t MAX_ERASE_PAGES = 255;
+/** Silence in milliseconds after which a resynchronized line is assumed to
+ * carry no more replies. */
+static const unsigned RESYNC_QUIET_TIMEOUT = 100;
+
+/** Properties of the connected device. */
+typedef struct {
+    uint8_t bootloaderVer;
+    bool commands[NUM_COMMANDS_KNOWN];
+    uint32_t flashBeginAddr;
+    uint32_t flashEndAddr;
+    /** The flash layout, including the erase unit sizes. */
+    const DeviceInfo *device;
+    useconds_t eraseDelay;
+    /** Minimum time between the ACK of one write block and the start of the
+     * next.  Starts at StmSession::minWriteGap, is raised from the round
+     * trips of accepted blocks if the device rejects a block, and decays
+     * again while blocks are accepted. */
+    useconds_t writeGap;
+    /** Round trip of the last block the device accepted. */
+    useconds_t roundTrip;
+    /** Blocks accepted since the write gap last changed. */
+    unsigned cleanBlocks;
+} DeviceParameters;
+
+struct StmSession {
+    /** The serial device.  The session does not own it. */
+    SerialDev *dev;
+    /** Filled in by stmGetDevParams(). */
+    DeviceParameters params;
+    /** See stmSetWriteGap(). */
+    useconds_t minWriteGap;
+    /** See stmSetPipelineDepth(). */
+    int pipelineDepth;
+    /** Called as steps advance, or NULL. */
+    StmProgressFn progress;
+    void *user;
+    StmStats stats;
+    /** The last failure, see stmGetError(). */
+    StmError error;
+    char errorMessage[STM_ERROR_MESSAGE_SIZE];
+};
+
+/** State of the flash under a block whose write failed. */
+typedef enum {
+    /** The block was programmed after all. */
+    BLOCK_WRITTEN,
+    /** The flash is still erased, so the block can be sent again. */
+    BLOCK_ERASED,
+    /** The flash holds other data, or could not be read. */
+    BLOCK_DAMAGED
+} BlockState;
+
+static int cmdIndex(uint8_t cmd);
+static bool cmdSupported(StmSession *session, Command cmd);
+
+static uint8_t *put16(uint8_t *buffer, uint16_t data, uint8_t *checksum);
+
+static bool stmRecvAck(StmSession *session);
+static bool stmRecvAckWithin(StmSession *session, unsigned timeout);
+static unsigned eraseTimeout(StmSession *session, size_t first,
+        size_t count);
+static bool stmSendByte(StmSession *session, uint8_t byte);
+static bool stmSendAddr(StmSession *session, uint32_t addr);
+static bool stmSendBlock(StmSession *session, const uint8_t *buffer,
+        size_t size);
+static size_t putAddr(uint8_t *frame, uint32_t addr);
+static size_t putBlock(uint8_t *frame, const uint8_t *buffer, size_t size,
+        uint8_t fill);
+
+static bool stmErasePages(StmSession *session, uint16_t first,
+        uint16_t count);
+static bool stmWriteBlock(StmSession *session, uint32_t addr,
+        const uint8_t *buff, size_t size);
+static bool stmWriteBlockPaced(StmSession *session, MemBlock block,
+        uint64_t *lastAck);
+static bool stmQueueWriteBlock(StmSession *session, MemBlock block);
+static bool stmRecvWriteAcks(StmSession *session);
+static BlockState stmCheckBlock(StmSession *session, MemBlock block);
+static void stmResync(StmSession *session, size_t replies);
+static bool stmReadBlock(StmSession *session, uint32_t addr, uint8_t *buff,
+        size_t size);
+static void paceAccepted(StmSession *session, useconds_t roundTrip);
+static void paceRejected(StmSession *session);
+static uint8_t erasedValue(StmSession *session);
+static size_t numPages(StmSession *session);
+static size_t pageIndex(StmSession *session, size_t addr);
+static MemBlock nextWriteBlock(StmSession *session,
+        const SparseBuffer *buffer, SparseBufferCursor *cursor,
+        const uint8_t *pages, uint8_t *scratch, unsigned long *done,
+        unsigned long *skipped);
+static void report(StmSession *session, StmStep step, int percent);
+static bool fail(StmSession *session, StmError error, const char *format, ...)
+        __attribute__((format(printf, 3, 4)));
+static bool failSerial(StmSession *session);
+
+int stmApiVersion(void) {
+    return STM_API_VERSION;
+}
+
+StmSession *stmCreateSession(SerialDev *dev) {
+    assert(dev);
+
+    StmSession *session = calloc(1, sizeof(StmSession));
+    if(!session) abort();
+    session->dev = dev;
+    session->pipelineDepth = 1;
+    return session;
+}
+
+void stmDestroySession(StmSession *session) {
+    free(session);
+}
+
+void stmSetPipelineDepth(StmSession *session, int depth) {
+    if(depth < 1) depth = 1;
+    if(depth > STM_MAX_PIPELINE_DEPTH) depth = STM_MAX_PIPELINE_DEPTH;
+    session->pipelineDepth = depth;
+}
+
+void stmSetWriteGap(StmSession *session, useconds_t gap) {
+    session->minWriteGap = gap;
+}
+
+void stmSetProgress(StmSession *session, StmProgressFn progress, void *user) {
+    session->progress = progress;
+    session->user = user;
+}
+
+void *stmGetUser(const StmSession *session) {
+    return session->user;
+}
+
+const StmStats *stmGetStats(const StmSession *session) {
+    return &session->stats;
+}
+
+StmError stmGetError(const StmSession *session) {
+    return session->error;
+}
+
+const char *stmGetErrorMessage(const StmSession *session) {
+    return session->errorMessage;
+}
+
+uint8_t stmGetBootloaderVer(const StmSession *session) {
+    return session->params.bootloaderVer;
+}
+
+uint32_t stmGetFlashBegin(const StmSession *session) {
+    return session->params.flashBeginAddr;
+}
+
+const DeviceInfo *stmGetDevice(const StmSession *session) {
+    return session->params.device;
+}
+
+bool stmConnect(StmSession *session) {
+    stmSerialSetDtr(session->dev, true);
+    usleep(10000);
+    stmSerialSetDtr(session->dev, false);
+    usleep(10000);
+
+    uint8_t data = SYNC_BYTE;
+    int retries = 0;
+    do {
+        if(++retries > MAX_RETRIES) {
+            return fail(session, STM_ERROR_TIMEOUT,
+                    "no answer from the bootloader");
+        }
+        (void)stmSerialWrite(session->dev, &data, 1);
+        uint64_t deadline = stmSerialClock() + SYNC_TIMEOUT * 1000;
+        SerialStatus status = stmSerialReadDeadline(session->dev, &data, 1,
+                deadline);
+        if(status != SERIAL_OK) data = SYNC_BYTE;
+    } while(data != ACK);
+    return true;
+}
+
+static int cmdIndex(uint8_t cmd) {
+    int idx = -1;
+    switch(cmd) {
+    case CMD_GET_VERSION:     idx++;
+    case CMD_GET_READ_STATUS: idx++;
+    case CMD_GET_ID:          idx++;
+    case CMD_READ_MEM:        idx++;
+    case CMD_GO:              idx++;
+    case CMD_WRITE_MEM:       idx++;
+    case CMD_ERASE:           idx++;
+    case CMD_EXTENDED_ERASE:  idx++;
+    case CMD_WRITE_PROTECT:   idx++;
+    case CMD_WRITE_UNPROTECT: idx++;
+    case CMD_READ_PROTECT:    idx++;
+    case CMD_READ_UNPROTECT:  idx++;
+    default:                  break;
+    }
+    assert(idx < NUM_COMMANDS_KNOWN);
+    return idx;
+}
+
+static bool cmdSupported(StmSession *session, Command cmd) {
+    int idx = cmdIndex(cmd);
+    assert(idx >= 0);
+    return session->params.commands[idx];
+}
+
+static uint8_t *put16(uint8_t *buffer, uint16_t data, uint8_t *checksum) {
+    buffer[0] = (data >> 8) & 0xFF;
+    buffer[1] = data & 0xFF;
+    *checksum ^= buffer[0] ^ buffer[1];
+    return buffer + 2;
+}
+
+static bool stmRecvAck(StmSession *session) {
+    return stmRecvAckWithin(session, ACK_TIMEOUT);
+}
+
+static bool stmRecvAckWithin(StmSession *session, unsigned timeout) {
+    uint8_t data = 0;
+    uint64_t deadline = stmSerialClock() + (uint64_t)timeout * 1000;
+    SerialStatus status = stmSerialReadDeadline(session->dev, &data, 1,
+            deadline);
+    if(status == SERIAL_TIMEOUT) {
+        return fail(session, STM_ERROR_TIMEOUT, "no response within %u ms",
+                timeout);
+    }
+    if(status != SERIAL_OK) return failSerial(session);
+    if(data == NACK) {
+        return fail(session, STM_ERROR_NACK, "the device rejected a command");
+    }
+    if(data != ACK) {
+        return fail(session, STM_ERROR_PROTOCOL,
+                "unexpected answer 0x%02x", data);
+    }
+    return true;
+}
+
+static unsigned eraseTimeout(StmSession *session, size_t first,
+        size_t count) {
+    size_t size = stmDevicePageAddr(session->params.device, first + count) -
+            stmDevicePageAddr(session->params.device, first);
+    return ACK_TIMEOUT + ERASE_TIMEOUT_PER_KB * (size / 1024);
+}
+
+static bool stmSendByte(StmSession *session, uint8_t byte) {
+    uint8_t buffer[] = { byte, ~byte };
+    if(!stmSerialWrite(session->dev, buffer, sizeof(buffer))) {
+        return failSerial(session);
+    }
+    return stmRecvAck(session);
+}
+
+static bool stmSendAddr(StmSession *session, uint32_t addr) {
+    uint8_t buffer[5];
+    if(!stmSerialWrite(session->dev, buffer, putAddr(buffer, addr))) {
+        return failSerial(session);
+    }
+    return stmRecvAck(session);
+}
+
+static bool stmSendBlock(StmSession *session, const uint8_t *buffer,
+        size_t size) {
+    /* Send the whole frame with a single write, so that USB-serial adapters
+     * do not turn each part into its own transfer. */
+    uint8_t frame[MAX_BLOCK_SIZE + 2];
+    size_t frameSize = putBlock(frame, buffer, size, erasedValue(session));
+    if(!stmSerialWrite(session->dev, frame, frameSize)) {
+        return failSerial(session);
+    }
+    return stmRecvAck(session);
+}
+
+static size_t putAddr(uint8_t *frame, uint32_t addr) {
+    assert(addr % 4 == 0);
+    frame[4] = 0;
+    for(int i = 0; i < 4; ++i) {
+        frame[i] = (uint8_t)(addr >> ((3 - i) * CHAR_BIT));
+        frame[4] ^= frame[i];
+    }
+    return 5;
+}
+
+static size_t putBlock(uint8_t *frame, const uint8_t *buffer, size_t size,
+        uint8_t fill) {
+    assert(size > 0 && size <= MAX_BLOCK_SIZE);
+    size_t padding = (4 - (size % 4)) % 4;
+    uint8_t n = size + padding - 1;
+    uint8_t checksum = n;
+    frame[0] = n;
+    memcpy(frame + 1, buffer, size);
+    memset(frame + 1 + size, fill, padding);
+    for(size_t i = 1; i <= size + padding; ++i) checksum ^= frame[i];
+    frame[size + padding + 1] = checksum;
+    return size + padding + 2;
+}
+
+int stmGetDevParams(StmSession *session) {
+    DeviceParameters *params = &session->params;
+    uint8_t data = 0;
+
+    params->flashBeginAddr = 0x08000000;
+    params->flashEndAddr = 0x08008000;
+    params->device = NULL;
+    params->eraseDelay = 40000;
+    params->writeGap = session->minWriteGap;
+    params->roundTrip = 0;
+    params->cleanBlocks = 0;
+
+    if(!stmSendByte(session, CMD_GET_VERSION)) return -1;
+    if(!stmSerialRead(session->dev, &data, 1)) {
+        failSerial(session);
+        return -2;
+    }
+    if(!stmSerialRead(session->dev, &params->bootloaderVer, 1)) {
+        failSerial(session);
+        return -3;
+    }
+    for(int i = 0; i < NUM_COMMANDS_KNOWN; ++i) params->commands[i] = false;
+    for(int i = data; i > 0; --i) {
+        if(!stmSerialRead(session->dev, &data, 1)) {
+            failSerial(session);
+            return -4;
+        }
+        int idx = cmdIndex(data);
+        if(idx >= 0) params->commands[idx] = true;
+    }
+    if(!stmRecvAck(session)) return -5;
+
+    if(!cmdSupported(session, CMD_GET_ID)) {
+        fail(session, STM_ERROR_UNSUPPORTED,
+                "the device does not support GET_ID");
+        return -6;
+    }
+    if(!stmSendByte(session, CMD_GET_ID)) return -7;
+    if(!stmSerialRead(session->dev, &data, 1)) {
+        failSerial(session);
+        return -8;
+    }
+    if(data != 1) {
+        fail(session, STM_ERROR_PROTOCOL, "device ID of %d bytes", data + 1);
+        return -9;
+    }
+    uint16_t id = 0;
+    for(int i = data; i >= 0; --i) {
+        if(!stmSerialRead(session->dev, &data, 1)) {
+            failSerial(session);
+            return -10;
+        }
+        if(i < 2) {
+            id |= data << (i * CHAR_BIT);
+        }
+    }
+    if(!stmRecvAck(session)) return -11;
+
+    const DeviceInfo *info = stmFindDevice(id);
+    if(!info) {
+        fail(session, STM_ERROR_UNSUPPORTED, "device ID 0x%x is unsupported",
+                id);
+        return -12;
+    }
+    params->flashBeginAddr = info->flashBeginAddr;
+    params->flashEndAddr = info->flashEndAddr;
+    params->device = info;
+
+    return true;
+}
+
+static bool stmErasePages(StmSession *session, uint16_t first,
+        uint16_t count) {
+    if(count == 0) return true;
+
+    if(cmdSupported(session, CMD_ERASE)) {
+        if(first > 255 || first + count - 1 > 255) {
+            return fail(session, STM_ERROR_RANGE,
+                    "ERASE cannot reach page %d", first + count - 1);
+        }
+
+        if(!stmSendByte(session, CMD_ERASE)) return false;
+        uint8_t frame[UINT8_MAX + 3];
+        uint8_t checksum = count - 1;
+        frame[0] = count - 1;
+        for(uint16_t i = 0; i < count; ++i) {
+            frame[1 + i] = first + i;
+            checksum ^= frame[1 + i];
+        }
+        frame[1 + count] = checksum;
+        if(!stmSerialWrite(session->dev, frame, count + 2)) {
+            return failSerial(session);
+        }
+    } else if(cmdSupported(session, CMD_EXTENDED_ERASE)) {
+        if(count > 0xFFF0) {
+            return fail(session, STM_ERROR_RANGE,
+                    "EXTENDED_ERASE cannot take %d pages", count);
+        }
+
+        if(!stmSendByte(session, CMD_EXTENDED_ERASE)) return false;
+        size_t size = 2 * ((size_t)count + 1) + 1;
+        uint8_t *frame = malloc(size);
+        if(!frame) abort();
+        uint8_t checksum = 0;
+        uint8_t *p = put16(frame, count - 1, &checksum);
+        for(uint16_t i = 0; i < count; ++i) {
+            p = put16(p, first + i, &checksum);
+        }
+        *p = checksum;
+        bool ok = stmSerialWrite(session->dev, frame, size);
+        free(frame);
+        if(!ok) return failSerial(session);
+    } else {
+        return fail(session, STM_ERROR_UNSUPPORTED,
+                "the device supports no known erase command");
+    }
+
+    if(!stmRecvAckWithin(session, eraseTimeout(session, first, count))) {
+        return false;
+    }
+    session->stats.pagesErased += count;
+    return true;
+}
+
+bool stmEraseAll(StmSession *session) {
+    if(cmdSupported(session, CMD_ERASE)) {
+        if(!stmSendByte(session, CMD_ERASE)) return false;
+        uint8_t data[] = { 0xFF, 0x00 };
+        if(!stmSerialWrite(session->dev, data, sizeof(data))) {
+            return failSerial(session);
+        }
+    } else if(cmdSupported(session, CMD_EXTENDED_ERASE)) {
+        if(!stmSendByte(session, CMD_EXTENDED_ERASE)) return false;
+        uint8_t data[] = { 0xFF, 0xFF, 0x00 };
+        if(!stmSerialWrite(session->dev, data, sizeof(data))) {
+            return failSerial(session);
+        }
+    } else {
+        return fail(session, STM_ERROR_UNSUPPORTED,
+                "the device supports no known erase command");
+    }
+
+    bool ok = true;
+    report(session, STM_ERASE, 0);
+    unsigned timeout = eraseTimeout(session, 0, numPages(session));
+    if(stmRecvAckWithin(session, timeout)) {
+        useconds_t delay = (session->params.eraseDelay / 100) + 1;
+        for(int i = 1; i <= 100; ++i) {
+            usleep(delay);
+            report(session, STM_ERASE, i);
+        }
+        session->stats.pagesErased += numPages(session);
+    } else {
+        // Global erase failed, try page-by-page erase.
+        ok = stmErasePages(session, 0, numPages(session));
+    }
+    report(session, STM_ERASE, STM_STEP_DONE);
+
+    return ok;
+}
+
+static bool stmWriteBlock(StmSession *session, uint32_t addr,
+        const uint8_t *buff, size_t size) {
+    if(!stmSendByte(session, CMD_WRITE_MEM)) return false;
+    if(!stmSendAddr(session, addr)) return false;
+    if(!stmSendBlock(session, buff, size)) return false;
+    return true;
+}
+
+static bool stmReadBlock(StmSession *session, uint32_t addr, uint8_t *buff,
+        size_t size) {
+    if(!stmSendByte(session, CMD_READ_MEM)) return false;
+    if(!stmSendAddr(session, addr)) return false;
+    if(!stmSendByte(session, size - 1)) return false;
+    if(!stmSerialRead(session->dev, buff, size)) return failSerial(session);
+    session->stats.bytesRead += size;
+    return true;
+}
+
+static bool stmWriteBlockPaced(StmSession *session, MemBlock block,
+        uint64_t *lastAck) {
+    DeviceParameters *params = &session->params;
+    int retries = 0;
+    for(;;) {
+        /* The final ACK of a block means the bootloader has finished
+         * programming it, so only wait if the device has shown that it
+         * needs extra time between blocks. */
+        uint64_t start = stmSerialClock();
+        if(*lastAck + params->writeGap > start) {
+            usleep(*lastAck + params->writeGap - start);
+            start = stmSerialClock();
+        }
+        bool ok = stmWriteBlock(session, block.offset, block.data,
+                block.length);
+        *lastAck = stmSerialClock();
+        if(ok) {
+            paceAccepted(session, *lastAck - start);
+            return true;
+        }
+        paceRejected(session);
+
+        /* The data stage can fail after part of the block is programmed,
+         * and flash cannot be programmed twice, so look before sending the
+         * block again. */
+        stmResync(session, 0);
+        BlockState state = stmCheckBlock(session, block);
+        *lastAck = stmSerialClock();
+        if(state == BLOCK_WRITTEN) return true;
+        if(state == BLOCK_DAMAGED) return false;
+        if(++retries >= MAX_RETRIES) return false;
+        session->stats.retries++;
+    }
+}
+
+static bool stmQueueWriteBlock(StmSession *session, MemBlock block) {
+    /* Command, address and data of one transaction in a single write.  The
+     * bootloader's three ACKs are collected later by stmRecvWriteAcks(). */
+    uint8_t frame[2 + 5 + MAX_BLOCK_SIZE + 2];
+    size_t size = 0;
+    frame[size++] = CMD_WRITE_MEM;
+    frame[size++] = ~CMD_WRITE_MEM;
+    size += putAddr(frame + size, block.offset);
+    size += putBlock(frame + size, block.data, block.length,
+            erasedValue(session));
+    if(!stmSerialWrite(session->dev, frame, size)) return failSerial(session);
+    return true;
+}
+
+static bool stmRecvWriteAcks(StmSession *session) {
+    /* Command, address and data stages.  Stop at the first NACK, since the
+     * bootloader does not answer the remaining stages after it. */
+    for(int i = 0; i < 3; ++i) {
+        if(!stmRecvAck(session)) return false;
+    }
+    return true;
+}
+
+/** \brief Read back a block whose write failed.  Reports damaged blocks. */
+static BlockState stmCheckBlock(StmSession *session, MemBlock block) {
+    uint8_t flashBuff[MAX_BLOCK_SIZE];
+    bool erased = cmdSupported(session, CMD_READ_MEM)
+            && stmReadBlock(session, block.offset, flashBuff, block.length);
+    if(erased && memcmp(block.data, flashBuff, block.length) == 0) {
+        return BLOCK_WRITTEN;
+    }
+    for(size_t i = 0; erased && i < block.length; ++i) {
+        if(flashBuff[i] != erasedValue(session)) erased = false;
+    }
+    if(!erased) {
+        fail(session, STM_ERROR_VERIFY, "block at 0x%08zx failed to write "
+                "and cannot be written again", block.offset);
+        return BLOCK_DAMAGED;
+    }
+    return BLOCK_ERASED;
+}
+
+/** \brief Bring the host and the bootloader back in step after a failure.
+ *
+ * \param session The session.
+ * \param replies The number of replies the bootloader still owes for
+ *                transactions already sent.
+ */
+static void stmResync(StmSession *session, size_t replies) {
+    uint8_t data;
+    uint64_t deadline = stmSerialClock() + (uint64_t)ACK_TIMEOUT * 1000;
+    while(replies > 0 && stmSerialReadDeadline(session->dev, &data, 1,
+            deadline) == SERIAL_OK) {
+        replies--;
+        deadline = stmSerialClock() + (uint64_t)ACK_TIMEOUT * 1000;
+    }
+    /* Then drop anything else, such as the answers to a rejected frame
+     * that the bootloader parsed as commands. */
+    do {
+        deadline = stmSerialClock() + (uint64_t)RESYNC_QUIET_TIMEOUT * 1000;
+    } while(stmSerialReadDeadline(session->dev, &data, 1, deadline)
+            == SERIAL_OK);
+    (void)stmSerialFlush(session->dev);
+}
+
+/** \brief Let the write gap decay while the device accepts blocks. */
+static void paceAccepted(StmSession *session, useconds_t roundTrip) {
+    DeviceParameters *params = &session->params;
+    params->roundTrip = roundTrip;
+    if(++params->cleanBlocks < GAP_DECAY_BLOCKS) return;
+    params->cleanBlocks = 0;
+    params->writeGap /= 2;
+    if(params->writeGap < session->minWriteGap) {
+        params->writeGap = session->minWriteGap;
+    }
+}
+
+/** \brief Raise the write gap after the device rejected a block.
+ *
+ * The round trip of a rejected block includes the time spent waiting for
+ * its ACK, so the gap grows from that of the last accepted block instead,
+ * and stays below the fixed pause it replaced.
+ */
+static void paceRejected(StmSession *session) {
+    DeviceParameters *params = &session->params;
+    useconds_t gap = params->writeGap * 2;
+    if(gap < params->roundTrip) gap = params->roundTrip;
+    if(gap > MAX_WRITE_GAP) gap = MAX_WRITE_GAP;
+    if(gap > params->writeGap) params->writeGap = gap;
+    params->cleanBlocks = 0;
+}
+
+static uint8_t erasedValue(StmSession *session) {
+    return session->params.device->erasedValue;
+}
+
+static size_t numPages(StmSession *session) {
+    return stmDevicePageCount(session->params.device);
+}
+
+static size_t pageIndex(StmSession *session, size_t addr) {
+    return stmDevicePageIndex(session->params.device, addr);
+}
+
+uint8_t *stmMapPages(StmSession *session, const SparseBuffer *buffer) {
+    size_t imageBegin;
+    size_t imageEnd;
+    if(SparseBuffer_bounds(buffer, &imageBegin, &imageEnd)
+            && (imageBegin < session->params.flashBeginAddr
+                || imageEnd > session->params.flashEndAddr)) {
+        fail(session, STM_ERROR_RANGE, "image at 0x%08zx-0x%08zx lies "
+                "outside flash at 0x%08x-0x%08x", imageBegin, imageEnd,
+                session->params.flashBeginAddr, session->params.flashEndAddr);
+        return NULL;
+    }
+
+    uint8_t *pages = calloc(numPages(session), 1);
+    if(!pages) abort();
+
+    MemBlock block;
+    SparseBufferCursor cursor;
+    SparseBuffer_begin(buffer, &cursor);
+    while((block = SparseBuffer_next(buffer, &cursor, 0)).data) {
+        size_t end = pageIndex(session, block.offset + block.length - 1);
+        size_t page = pageIndex(session, block.offset);
+        for(; page <= end; ++page) pages[page] = 1;
+    }
+
+    return pages;
+}
+
+bool stmDiffPages(StmSession *session, const SparseBuffer *buffer,
+        uint8_t *pages) {
+    if(!cmdSupported(session, CMD_READ_MEM)) {
+        return fail(session, STM_ERROR_UNSUPPORTED,
+                "the device does not support READ_MEM");
+    }
+
+    report(session, STM_COMPARE, 0);
+
+    size_t bufferSize = SparseBuffer_size(buffer);
+    MemBlock block;
+    SparseBufferCursor cursor;
+    uint8_t scratch[MAX_BLOCK_SIZE];
+    uint8_t flashBuff[MAX_BLOCK_SIZE];
+    long bytesRead = 0;
+    bool ok = true;
+
+    memset(pages, 0, numPages(session));
+    SparseBuffer_begin(buffer, &cursor);
+    while(ok) {
+        /* Read each window holding data at once, then compare only the data
+         * in it; the bytes in between need not match. */
+        SparseBufferCursor dataCursor = cursor;
+        size_t dataLength;
+        MemBlock span = SparseBuffer_nextAligned(buffer, &cursor,
+                MAX_BLOCK_SIZE, 4, erasedValue(session), scratch,
+                &dataLength);
+        if(!span.data) break;
+
+        /* No need to read back pages that already differ. */
+        size_t first = pageIndex(session, span.offset);
+        size_t last = pageIndex(session, span.offset + span.length - 1);
+        bool known = true;
+        for(size_t page = first; page <= last; ++page) {
+            if(!pages[page]) known = false;
+        }
+        if(!known) {
+            ok = stmReadBlock(session, span.offset, flashBuff, span.length);
+        }
+        while(ok && !known && (block = SparseBuffer_nextBefore(buffer,
+                &dataCursor, span.offset + span.length)).data) {
+            const uint8_t *flash = flashBuff + (block.offset - span.offset);
+            for(size_t i = 0; i < block.length; ++i) {
+                if(block.data[i] != flash[i]) {
+                    pages[pageIndex(session, block.offset + i)] = 1;
+                }
+            }
+        }
+        bytesRead += dataLength;
+        report(session, STM_COMPARE, bytesRead * 100 / bufferSize);
+    }
+
+    report(session, STM_COMPARE, STM_STEP_DONE);
+    return ok;
+}
+
+bool stmErase(StmSession *session, const uint8_t *pages) {
+    report(session, STM_ERASE, 0);
+
+    size_t count = numPages(session);
+    size_t page = 0;
+    size_t marked = 0;
+    size_t erased = 0;
+    bool ok = true;
+
+    for(size_t i = 0; i < count; ++i) marked += pages[i] != 0;
+
+    while(ok && page < count) {
+        if(!pages[page]) {
+            page++;
+            continue;
+        }
+        size_t run = 1;
+        while(page + run < count && pages[page + run] &&
+                run < MAX_ERASE_PAGES) {
+            run++;
+        }
+        ok = stmErasePages(session, page, run);
+        page += run;
+        erased += run;
+        report(session, STM_ERASE, erased * 100 / marked);
+    }
+
+    report(session, STM_ERASE, STM_STEP_DONE);
+    return ok;
+}
+
+static MemBlock nextWriteBlock(StmSession *session,
+        const SparseBuffer *buffer, SparseBufferCursor *cursor,
+        const uint8_t *pages, uint8_t *scratch, unsigned long *done,
+        unsigned long *skipped) {
+    for(;;) {
+        /* Whole words in 256 byte aligned windows, so that each block is
+         * written with one transaction.  Pages are multiples of the window
+         * size on every known device, so a window never straddles pages. */
+        size_t dataLength;
+        MemBlock block = SparseBuffer_nextAligned(buffer, cursor,
+                MAX_BLOCK_SIZE, 4, erasedValue(session), scratch,
+                &dataLength);
+        if(!block.data) return block;
+        *done += dataLength;
+
+        size_t page = pageIndex(session, block.offset);
+        assert(page == pageIndex(session, block.offset + block.length - 1));
+        /* Unchanged pages, which are not erased, are never programmed. */
+        if(pages && !pages[page]) {
+            *skipped += block.length;
+            continue;
+        }
+
+        /* Every page is erased before it is written, and erased flash
+         * already reads as the erased value.  Leave out erased words at
+         * either end of the block. */
+        uint8_t erased = erasedValue(session);
+        size_t lead = 0;
+        while(lead < block.length && block.data[lead] == erased) lead++;
+        if(lead == block.length) {
+            *skipped += block.length;
+            continue;
+        }
+        lead -= lead % 4;
+        size_t end = block.length;
+        while(block.data[end - 1] == erased) end--;
+
+        *skipped += lead + (block.length - end);
+        block.offset += lead;
+        block.data += lead;
+        block.length = end - lead;
+        return block;
+    }
+}
+
+bool stmWrite(StmSession *session, const SparseBuffer *buffer,
+        const uint8_t *pages) {
+    if(!cmdSupported(session, CMD_WRITE_MEM)) {
+        return fail(session, STM_ERROR_UNSUPPORTED,
+                "the device does not support WRITE_MEM");
+    }
+
+    report(session, STM_WRITE, 0);
+
+    size_t bufferSize = SparseBuffer_size(buffer);
+    MemBlock block;
+    SparseBufferCursor cursor;
+    unsigned long bytesDone = 0;
+    unsigned long bytesWritten = 0;
+    unsigned long bytesSkipped = 0;
+    uint64_t lastAck = 0;
+    bool ok = true;
+
+    /* Blocks may point into the scratch space of their pipeline slot. */
+    MemBlock pending[STM_MAX_PIPELINE_DEPTH];
+    uint8_t scratch[STM_MAX_PIPELINE_DEPTH][MAX_BLOCK_SIZE];
+    size_t head = 0;
+    size_t count = 0;
+    /* Depth 1 is lock-step and queues nothing. */
+    int depth = session->pipelineDepth > 1 ? session->pipelineDepth : 0;
+    if(depth > STM_MAX_PIPELINE_DEPTH) depth = STM_MAX_PIPELINE_DEPTH;
+
+    SparseBuffer_begin(buffer, &cursor);
+    while(ok) {
+        /* Keep up to depth transactions in flight. */
+        while(ok && count < (size_t)depth && (block = nextWriteBlock(session,
+                buffer, &cursor, pages,
+                scratch[(head + count) % STM_MAX_PIPELINE_DEPTH],
+                &bytesDone, &bytesSkipped)).data) {
+            pending[(head + count++) % STM_MAX_PIPELINE_DEPTH] = block;
+            ok = stmQueueWriteBlock(session, block);
+        }
+        if(!ok) break;
+
+        bool done = false;
+        if(count > 0) {
+            block = pending[head];
+            head = (head + 1) % STM_MAX_PIPELINE_DEPTH;
+            count--;
+            if(depth > 0) {
+                done = stmRecvWriteAcks(session);
+                if(!done) {
+                    /* The rest of the queued stream can no longer be
+                     * trusted.  Collect the three ACKs owed for each
+                     * transaction still queued, then continue in lock-step
+                     * from this block. */
+                    stmResync(session, 3 * count);
+                    depth = 0;
+                }
+            }
+            if(!done) {
+                /* The block may have been programmed, in part or in full,
+                 * and flash cannot be programmed twice. */
+                BlockState state = stmCheckBlock(session, block);
+                if(state == BLOCK_DAMAGED) {
+                    ok = false;
+                    break;
+                }
+                done = state == BLOCK_WRITTEN;
+            }
+        } else if(!(block = nextWriteBlock(session, buffer, &cursor, pages,
+                scratch[head], &bytesDone, &bytesSkipped)).data) {
+            break;
+        }
+
+        if(done) {
+            lastAck = stmSerialClock();
+        } else {
+            ok = stmWriteBlockPaced(session, block, &lastAck);
+        }
+        bytesWritten += block.length;
+        report(session, STM_WRITE, bytesDone * 100 / bufferSize);
+    }
+
+    session->stats.bytesWritten += bytesWritten;
+    session->stats.bytesSkipped += bytesSkipped;
+    report(session, STM_WRITE, STM_STEP_DONE);
+    return ok;
+}
+
+bool stmVerify(StmSession *session, const SparseBuffer *buffer) {
+    if(!cmdSupported(session, CMD_READ_MEM)) {
+        return fail(session, STM_ERROR_UNSUPPORTED,
+                "the device does not support READ_MEM");
+    }
+
+    report(session, STM_VERIFY, 0);
+
+    size_t bufferSize = SparseBuffer_size(buffer);
+    MemBlock block;
+    SparseBufferCursor cursor;
+    uint8_t scratch[MAX_BLOCK_SIZE];
+    uint8_t flashBuff[MAX_BLOCK_SIZE];
+    long bytesRead = 0;
+    bool ok = true;
+
+    SparseBuffer_begin(buffer, &cursor);
+    while(ok) {
+        SparseBufferCursor dataCursor = cursor;
+        size_t dataLength;
+        MemBlock span = SparseBuffer_nextAligned(buffer, &cursor,
+                MAX_BLOCK_SIZE, 4, erasedValue(session), scratch,
+                &dataLength);
+        if(!span.data) break;
+
+        ok = stmReadBlock(session, span.offset, flashBuff, span.length);
+        while(ok && (block = SparseBuffer_nextBefore(buffer, &dataCursor,
+                span.offset + span.length)).data) {
+            if(memcmp(block.data, flashBuff + (block.offset - span.offset),
+                    block.length) != 0) {
+                ok = fail(session, STM_ERROR_VERIFY, "flash differs from the "
+                        "image at 0x%08zx", block.offset);
+            }
+        }
+        bytesRead += dataLength;
+        report(session, STM_VERIFY, bytesRead * 100 / bufferSize);
+    }
+
+    report(session, STM_VERIFY, STM_STEP_DONE);
+    return ok;
+}
+
+bool stmRun(StmSession *session, uint32_t addr) {
+    if(!stmSendByte(session, CMD_GO)) return false;
+    return stmSendAddr(session, addr);
+}
+
+static void report(StmSession *session, StmStep step, int percent) {
+    if(session->progress) session->progress(session, step, percent);
+}
+
+/** \brief Record the cause of a failure in the session.
+ *
+ * \return \c false, for the caller to return.
+ */
+static bool fail(StmSession *session, StmError error, const char *format,
+        ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(session->errorMessage, sizeof(session->errorMessage), format,
+            args);
+    va_end(args);
+    session->error = error;
+    return false;
+}
+
+/** \brief Record the failure of a serial function in the session. */
+static bool failSerial(StmSession *session) {
+    return fail(session, stmLastError(), "%s", stmLastErrorMessage());
+}
@@ -0,0 +1,255 @@
+#ifndef STM32SPROG_STM32_H
+#define STM32SPROG_STM32_H
+/** \file stm32.h
+ *
+ * Programs STM32 devices through the USART bootloader (ST AN3155).  All
+ * state lives in a \ref StmSession, so separate sessions may be used from
+ * separate threads.  Functions that fail record why in the session, see
+ * stmGetError().
+ *
+ * Together with serial.h, sparse-buffer.h, firmware.h, devices.h and
+ * error.h, this is the interface of libstm32sprog.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "devices.h"
+#include "error.h"
+#include "serial.h"
+#include "sparse-buffer.h"
+
+/** Version of the library interface.  Raised whenever a change breaks
+ * existing callers. */
+#define STM_API_VERSION 1
+
+/** Largest pipeline depth stmSetPipelineDepth() accepts. */
+#define STM_MAX_PIPELINE_DEPTH 16
+
+/** Value of the percent argument of \ref StmProgressFn when a step ends,
+ * successfully or not. */
+#define STM_STEP_DONE (-1)
+
+/** Steps that report their progress. */
+typedef enum {
+    STM_COMPARE,
+    STM_ERASE,
+    STM_WRITE,
+    STM_VERIFY
+} StmStep;
+
+/** Counters of the work done in a session. */
+typedef struct {
+    /** Bytes sent with WRITE_MEM. */
+    unsigned long bytesWritten;
+    /** Bytes of the image left out because flash already holds them. */
+    unsigned long bytesSkipped;
+    /** Bytes read with READ_MEM. */
+    unsigned long bytesRead;
+    unsigned long pagesErased;
+    /** Write blocks sent again after the device rejected them. */
+    unsigned long retries;
+} StmStats;
+
+/** A connection to the bootloader of one device.  Only the functions below
+ * access it, so that it may grow without breaking callers. */
+typedef struct StmSession StmSession;
+
+/** \brief Report the progress of a step.
+ *
+ * \param session The session doing the work.
+ * \param step The step.
+ * \param percent 0 when the step starts, up to 100 as it advances, and
+ *                \ref STM_STEP_DONE when it ends.
+ */
+typedef void (*StmProgressFn)(StmSession *session, StmStep step, int percent);
+
+/** \brief Get the interface version of the library in use.
+ *
+ * \return The \ref STM_API_VERSION the library was built with.  Callers
+ *         should check that it matches the version of their headers.
+ */
+int stmApiVersion(void);
+
+/** \brief Create a session on an open serial device.
+ *
+ * \param dev The serial device.  The session does not own it.
+ *
+ * \return The session, to be freed with stmDestroySession().
+ */
+StmSession *stmCreateSession(SerialDev *dev);
+
+/** \brief Free a session.  The serial device stays open.
+ *
+ * \param session The session.
+ */
+void stmDestroySession(StmSession *session);
+
+/** \brief Set the number of WRITE_MEM transactions that may be in flight.
+ *
+ * 1, the default, waits for each ACK before sending more, as the
+ * bootloader's USART has no FIFO to hold what it cannot yet take.  Larger
+ * values send whole transactions ahead and only suit links that buffer the
+ * bootloader's input, such as the simulator.
+ *
+ * \param session The session.
+ * \param depth The depth, clamped to 1..\ref STM_MAX_PIPELINE_DEPTH.
+ */
+void stmSetPipelineDepth(StmSession *session, int depth);
+
+/** \brief Set the least time between the ACK of one write block and the
+ * start of the next, for devices known to need it.
+ *
+ * The gap actually used starts here, grows from measured block round trips
+ * if the device rejects a block, and decays back while blocks are
+ * accepted.  0 by default.
+ *
+ * \param session The session.
+ * \param gap The time in microseconds.
+ */
+void stmSetWriteGap(StmSession *session, useconds_t gap);
+
+/** \brief Set the function called as steps advance.
+ *
+ * \param session The session.
+ * \param progress The function, or NULL.
+ * \param user For the caller, e.g. to identify the session in the callback.
+ */
+void stmSetProgress(StmSession *session, StmProgressFn progress, void *user);
+
+/** \brief Get the pointer given to stmSetProgress().
+ *
+ * \param session The session.
+ */
+void *stmGetUser(const StmSession *session);
+
+/** \brief Get the counters of the work done in a session.
+ *
+ * \param session The session.
+ */
+const StmStats *stmGetStats(const StmSession *session);
+
+/** \brief Get the cause of the last failure of a function of the session.
+ *
+ * \param session The session.
+ *
+ * \return The cause, or STM_ERROR_NONE if nothing has failed yet.
+ */
+StmError stmGetError(const StmSession *session);
+
+/** \brief Describe the last failure of a function of the session.
+ *
+ * \param session The session.
+ *
+ * \return A message such as "no response within 1000 ms", without a
+ *         trailing period, or an empty string if nothing has failed yet.
+ */
+const char *stmGetErrorMessage(const StmSession *session);
+
+/** \brief Get the bootloader version found by stmGetDevParams().
+ *
+ * \param session A session with device parameters.
+ *
+ * \return The major version in the high nibble, the minor in the low one.
+ */
+uint8_t stmGetBootloaderVer(const StmSession *session);
+
+/** \brief Get the address where flash begins.
+ *
+ * \param session A session with device parameters.
+ */
+uint32_t stmGetFlashBegin(const StmSession *session);
+
+/** \brief Get the flash layout of the device.
+ *
+ * \param session A session with device parameters.
+ */
+const DeviceInfo *stmGetDevice(const StmSession *session);
+
+/** \brief Reset the device into the bootloader and synchronize with it.
+ *
+ * \param session The session.
+ *
+ * \return \c true if the bootloader answered.
+ */
+bool stmConnect(StmSession *session);
+
+/** \brief Query the bootloader version, commands and device ID.
+ *
+ * \param session A connected session.
+ *
+ * \return \c true on success, or a negative code identifying the failed
+ *         step.
+ */
+int stmGetDevParams(StmSession *session);
+
+/** \brief Map the pages of flash that an image covers.
+ *
+ * \param session A session with device parameters.
+ * \param buffer The image.
+ *
+ * \return One byte per page, non-zero for pages holding image data, to be
+ *         freed by the caller; NULL if the image does not fit in flash.
+ */
+uint8_t *stmMapPages(StmSession *session, const SparseBuffer *buffer);
+
+/** \brief Find the pages whose contents differ from an image.
+ *
+ * \param session A session with device parameters.
+ * \param buffer The image.
+ * \param pages A page map, which is overwritten with the pages that differ.
+ *
+ * \return \c true on success, \c false if flash could not be read.
+ */
+bool stmDiffPages(StmSession *session, const SparseBuffer *buffer,
+        uint8_t *pages);
+
+/** \brief Erase the pages marked in a page map.
+ *
+ * \param session A session with device parameters.
+ * \param pages The page map.
+ *
+ * \return \c true on success, \c false if any error occurred.
+ */
+bool stmErase(StmSession *session, const uint8_t *pages);
+
+/** \brief Erase all of flash.
+ *
+ * \param session A session with device parameters.
+ *
+ * \return \c true on success, \c false if any error occurred.
+ */
+bool stmEraseAll(StmSession *session);
+
+/** \brief Write an image to erased flash.
+ *
+ * \param session A session with device parameters.
+ * \param buffer The image.
+ * \param pages If not NULL, only pages marked in this map are written.
+ *
+ * \return \c true on success, \c false if any error occurred.
+ */
+bool stmWrite(StmSession *session, const SparseBuffer *buffer,
+        const uint8_t *pages);
+
+/** \brief Compare flash with an image.
+ *
+ * \param session A session with device parameters.
+ * \param buffer The image.
+ *
+ * \return \c true if flash holds the image, \c false otherwise.
+ */
+bool stmVerify(StmSession *session, const SparseBuffer *buffer);
+
+/** \brief Start the firmware.
+ *
+ * \param session A session with device parameters.
+ * \param addr The address to jump to.
+ *
+ * \return \c true on success, \c false if any error occurred.
+ */
+bool stmRun(StmSession *session, uint32_t addr);
+
+#endif /* STM32SPROG_STM32_H */
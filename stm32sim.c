@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "devices.h"
+#include "simulator.h"
+
+static void printUsage(const SimConfig *defaults);
+static void onSignal(int sig);
+
+int main(int argc, char **argv) {
+    int opt;
+    char *linkName = NULL;
+    SimConfig config;
+
+    Simulator_defaultConfig(&config);
+    config.events = stdout;
+
+    while((opt = getopt(argc, argv, "b:E:f:hi:l:p:s:t:vW:x")) != -1) {
+        switch(opt) {
+        case 'b':
+            config.baud = atoi(optarg);
+            break;
+        case 'E':
+            config.eraseLatency = atol(optarg);
+            break;
+        case 'f':
+            config.failEvery = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            config.id = strtol(optarg, NULL, 0);
+            break;
+        case 'l':
+            linkName = optarg;
+            break;
+        case 'p':
+            config.pageSize = strtol(optarg, NULL, 0);
+            break;
+        case 's':
+            config.flashSize = strtol(optarg, NULL, 0);
+            break;
+        case 't':
+            config.turnaround = atol(optarg);
+            break;
+        case 'v':
+            config.trace = stderr;
+            break;
+        case 'W':
+            config.writeLatency = atol(optarg);
+            break;
+        case 'x':
+            config.extendedErase = true;
+            break;
+        case 'h':
+        default:
+            Simulator_defaultConfig(&config);
+            printUsage(&config);
+            return EXIT_FAILURE;
+        }
+    }
+
+    Simulator *sim = Simulator_create(&config);
+    if(!sim) {
+        fprintf(stderr, "Invalid configuration: %s.\n",
+                stmLastErrorMessage());
+        return EXIT_FAILURE;
+    }
+    const DeviceInfo *layout = Simulator_layout(sim);
+
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if(fd == -1 || grantpt(fd) == -1 || unlockpt(fd) == -1) {
+        fprintf(stderr, "Unable to allocate a pseudo-terminal.\n");
+        return EXIT_FAILURE;
+    }
+    const char *slaveName = ptsname(fd);
+
+    /* Keep the slave side open so that the master does not see a hangup
+     * between client sessions. */
+    int slave = open(slaveName, O_RDWR | O_NOCTTY);
+    struct termios opts;
+    if(slave == -1 || tcgetattr(slave, &opts) == -1) {
+        fprintf(stderr, "Unable to open \"%s\".\n", slaveName);
+        return EXIT_FAILURE;
+    }
+    cfmakeraw(&opts);
+    (void)tcsetattr(slave, TCSANOW, &opts);
+
+    if(linkName) {
+        (void)unlink(linkName);
+        if(symlink(slaveName, linkName) == -1) {
+            fprintf(stderr, "Unable to create link \"%s\".\n", linkName);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("Simulating device 0x%03x on %s\n", config.id,
+            linkName ? linkName : slaveName);
+    printf("Flash 0x%08x-0x%08x, %zu %s pages\n", layout->flashBeginAddr,
+            layout->flashEndAddr, stmDevicePageCount(layout),
+            layout->sectors ? "variable size" : "uniform");
+    fflush(stdout);
+
+    /* Without SA_RESTART, a signal interrupts the blocking read and ends
+     * the simulator, so the statistics still get printed. */
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    (void)sigaction(SIGINT, &action, NULL);
+    (void)sigaction(SIGTERM, &action, NULL);
+
+    Simulator_run(sim, fd);
+
+    SimStats stats = Simulator_stats(sim);
+    printf("%lu commands, %lu NACKs, %lu pages erased, "
+            "%lu bytes written, %lu bytes read\n",
+            stats.commands, stats.nacks, stats.pagesErased,
+            stats.bytesWritten, stats.bytesRead);
+
+    if(linkName) (void)unlink(linkName);
+    close(slave);
+    close(fd);
+    Simulator_destroy(sim);
+    return EXIT_SUCCESS;
+}
+
+static void printUsage(const SimConfig *defaults) {
+    fprintf(stderr,
+            "Usage: stm32sim OPTIONS\n"
+            "\n"
+            "OPTIONS:\n"
+            "  -b BAUD    Emulate the transfer time of BAUD. (off)\n"
+            "  -E USEC    Page erase latency. (%u)\n"
+            "  -f N       Reject every N-th write block.\n"
+            "  -h         Print this help.\n"
+            "  -i ID      Report device ID. (0x%03x)\n"
+            "  -l LINK    Create a symbolic link LINK to the pty.\n"
+            "  -p SIZE    Override the flash page size.\n"
+            "  -s SIZE    Override the flash size.\n"
+            "  -t USEC    Delay responses by USEC of turnaround latency.\n"
+            "  -v         Log commands to stderr.\n"
+            "  -W USEC    Write latency per WRITE_MEM block. (%u)\n"
+            "  -x         Use EXTENDED_ERASE instead of ERASE.\n"
+            "\n",
+            defaults->eraseLatency,
+            defaults->id,
+            defaults->writeLatency);
+}
+
+static void onSignal(int sig) {
+    (void)sig;
+}
@@ -1,6 +1,6 @@
-#include <assert.h>
 #include <getopt.h>
-#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -8,110 +8,172 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "devices.h"
 #include "firmware.h"
+#include "image-cache.h"
 #include "serial.h"
+#include "stm32.h"
 
 static const char *DEFAULT_DEV_NAME = "/dev/ttyUSB0";
 static const int DEFAULT_BAUD = 115200;
-static const int MAX_RETRIES = 10;
-
-static const size_t MAX_BLOCK_SIZE = 256;
-
-static const uint8_t ACK = 0x79;
-typedef enum {
-    CMD_GET_VERSION = 0x00,
-    CMD_GET_READ_STATUS = 0x01,
-    CMD_GET_ID = 0x02,
-    CMD_READ_MEM = 0x11,
-    CMD_GO = 0x21,
-    CMD_WRITE_MEM = 0x31,
-    CMD_ERASE = 0x43,
-    CMD_EXTENDED_ERASE = 0x44,
-    CMD_WRITE_PROTECT = 0x63,
-    CMD_WRITE_UNPROTECT = 0x73,
-    CMD_READ_PROTECT = 0x82,
-    CMD_READ_UNPROTECT = 0x92
-} Command;
-#define NUM_COMMANDS_KNOWN 12
-
-enum {
-    ID_LOW_DENSITY = 0x0412,
-    ID_MED_DENSITY = 0x0410,
-    ID_HI_DENSITY = 0x0414,
-    ID_CONNECTIVITY = 0x0418,
-    ID_MED_DENSITY_VALUE = 0x0420,
-    ID_HI_DENSITY_VALUE = 0x0428,
-    ID_XL_DENSITY = 0x0430,
-    ID_MED_DENSITY_ULTRA_LOW_POWER = 0x0436,
-    ID_HI_DENSITY_ULTRA_LOW_POWER = 0x0416
-};
+/** Interval between updates of the gang mode status line. */
+static const useconds_t PROGRESS_INTERVAL = 200000;
 
+/** What to do with each target, as given on the command line. */
+typedef struct {
+    int baud;
+    bool lowLatency;
+    bool diff;
+    bool erase;
+    bool verify;
+    bool run;
+    useconds_t minWriteGap;
+    int pipelineDepth;
+    /** The firmware file, or NULL if nothing is to be written. */
+    const char *fileName;
+    /** The parsed firmware, or NULL if it has not been parsed.  Shared by
+     * all targets, and read-only once the first target has placed it. */
+    SparseBuffer *firmware;
+    /** The format of the file, or FIRMWARE_AUTO to detect it when it is
+     * parsed. */
+    FirmwareFormat format;
+    /** The cache of planned images, or NULL. */
+    ImageCache *cache;
+    /** The contents of the firmware file, if there is a cache. */
+    FirmwareId id;
+} Options;
+
+/** One device being programmed. */
 typedef struct {
-    uint8_t bootloaderVer;
-    bool commands[NUM_COMMANDS_KNOWN];
-    uint32_t flashBeginAddr;
-    uint32_t flashEndAddr;
-    int flashPagesPerSector;
-    size_t flashPageSize;
-    useconds_t eraseDelay;
-    useconds_t writeDelay;
-} DeviceParameters;
+    const char *devName;
+    /** The current step and its progress.  In gang mode these are read by
+     * the main thread, under gangLock. */
+    const char *phase;
+    int percent;
+    bool done;
+    /** The reason the target failed, or empty on success. */
+    char error[128];
+    /** Time taken, in microseconds. */
+    uint64_t elapsed;
+    pthread_t thread;
+} Target;
+
+/** The image and page map for a device layout, planned once for all targets
+ * that share the layout. */
+typedef struct Plan Plan;
+struct Plan {
+    Plan *next;
+    const DeviceInfo *device;
+    const SparseBuffer *image;
+    const uint8_t *pages;
+    /** The cache entry holding the image and page map, or NULL if the page
+     * map was allocated and the image is the shared one. */
+    CachedImage *cached;
+};
 
 static void printUsage(void);
+static bool parseFormat(const char *name, FirmwareFormat *format);
+
+static bool programTarget(Target *target);
+static void *gangWorker(void *arg);
+static bool runGang(Target *targets, size_t count);
+static void printSummary(const Target *targets, size_t count);
+static void fail(Target *target, const char *format, ...);
+static void say(const char *format, ...);
+static void setPhase(Target *target, const char *phase);
+static const Plan *planFirmware(Target *target, StmSession *session);
+
+static void showProgress(StmSession *session, StmStep step, int percent);
+static void printProgressBar(int percent);
 
-static bool stmConnect(void);
-
-static int cmdIndex(uint8_t cmd);
-static bool cmdSupported(Command cmd);
+/** Names of the steps as shown in gang mode. */
+static const char *const STEP_NAMES[] = {
+    [STM_COMPARE] = "comparing",
+    [STM_ERASE] = "erasing",
+    [STM_WRITE] = "writing",
+    [STM_VERIFY] = "verifying"
+};
 
-static bool serialWrite16(const uint16_t data, uint8_t *checksum);
+/** Headings of the steps' progress bars. */
+static const char *const STEP_TITLES[] = {
+    [STM_COMPARE] = "Comparing",
+    [STM_ERASE] = "Erasing",
+    [STM_WRITE] = "Writing",
+    [STM_VERIFY] = "Verifying"
+};
 
-static bool stmRecvAck(void);
-static bool stmSendByte(uint8_t byte);
-static bool stmSendAddr(uint32_t addr);
-static bool stmSendBlock(const uint8_t *buffer, size_t size);
+static Options options;
+/** Whether several targets are programmed at once.  Set before any worker
+ * thread starts. */
+static bool gangMode = false;
 
-static int stmGetDevParams(void);
-static bool stmErasePages(uint16_t first, uint16_t count);
-static bool stmEraseAll(void);
-static bool stmWriteBlock(uint32_t addr, const uint8_t *buff, size_t size);
-static bool stmReadBlock(uint32_t addr, uint8_t *buff, size_t size);
-static bool stmErase(SparseBuffer *buffer);
-static bool stmWrite(SparseBuffer *buffer);
-static bool stmVerify(SparseBuffer *buffer);
-static bool stmRun(uint32_t addr);
-static void printProgressBar(int percent);
-
-static SerialDev *dev = NULL;
-static DeviceParameters devParams;
+/** Guards the shared plans and the progress of gang targets. */
+static pthread_mutex_t gangLock = PTHREAD_MUTEX_INITIALIZER;
+static bool firmwarePlaced = false;
+static uint32_t firmwareBase = 0;
+static Plan *plans = NULL;
 
 int main(int argc, char **argv) {
     bool success = true;
     int opt;
-    int baud = DEFAULT_BAUD;
-    char *devName = NULL;
     char *fileName = NULL;
-    SparseBuffer *buffer = NULL;
-    bool erase = false;
-    bool verify = false;
-    bool run = false;
+    const char *cacheDir = NULL;
+    Target *targets = NULL;
+    size_t numTargets = 0;
+
+    options.baud = DEFAULT_BAUD;
+    options.format = FIRMWARE_AUTO;
+    options.pipelineDepth = 1;
 
-    while((opt = getopt(argc, argv, "b:d:ehrvw:")) != -1) {
+    while((opt = getopt(argc, argv, "b:c:d:Def:g:hLP:rvw:")) != -1) {
         switch(opt) {
         case 'b':
-            baud = atoi(optarg);
+            options.baud = atoi(optarg);
             break;
-        case 'd':
-            devName = strdup(optarg);
+        case 'c':
+            cacheDir = optarg;
+            break;
+        case 'd': {
+            Target *more = realloc(targets,
+                    (numTargets + 1) * sizeof(Target));
+            if(!more) abort();
+            targets = more;
+            memset(&targets[numTargets], 0, sizeof(Target));
+            targets[numTargets++].devName = optarg;
+            break;
+        }
+        case 'D':
+            options.diff = true;
             break;
         case 'e':
-            erase = true;
+            options.erase = true;
+            break;
+        case 'f':
+            success = parseFormat(optarg, &options.format);
+            if(!success) {
+                fprintf(stderr, "Unknown file format \"%s\".\n", optarg);
+                printUsage();
+                goto ExitApp;
+            }
+            break;
+        case 'g':
+            options.minWriteGap = strtoul(optarg, NULL, 0);
+            break;
+        case 'L':
+            options.lowLatency = true;
+            break;
+        case 'P':
+            options.pipelineDepth = atoi(optarg);
+            if(options.pipelineDepth < 1) options.pipelineDepth = 1;
+            if(options.pipelineDepth > STM_MAX_PIPELINE_DEPTH) {
+                options.pipelineDepth = STM_MAX_PIPELINE_DEPTH;
+            }
             break;
         case 'r':
-            run = true;
+            options.run = true;
             break;
         case 'v':
-            verify = true;
+            options.verify = true;
             break;
         case 'w':
             fileName = strdup(optarg);
@@ -130,94 +192,86 @@ int main(int argc, char **argv) {
         goto ExitApp;
     }
 
-    success = erase || run || fileName != NULL;
+    success = options.erase || options.run || fileName != NULL;
     if(!success) {
         fprintf(stderr, "No actions specified.\n");
         printUsage();
         goto ExitApp;
     }
 
-    success = fileName || !verify;
+    success = fileName || !options.verify;
     if(!success) {
         fprintf(stderr, "Verification requires write.\n");
         printUsage();
         goto ExitApp;
     }
 
-    /**************************************/
-
-    dev = serialOpen(devName ? devName : DEFAULT_DEV_NAME, baud);
-    if(!success) goto ExitApp;
-
-    success = stmConnect();
+    success = !options.diff || (fileName && !options.erase);
     if(!success) {
-        fprintf(stderr, "STM32 not detected.\n");
+        fprintf(stderr, "Differential write requires write without erase.\n");
+        printUsage();
         goto ExitApp;
     }
 
-    int successint = stmGetDevParams();
-    if(!successint) {
-        fprintf(stderr, "Device not supported or error happened, code=%d.\n", successint);
-        goto ExitApp;
-    }
-    int major = devParams.bootloaderVer >> 4;
-    int minor = devParams.bootloaderVer & 0x0F;
-    printf("Bootloader version %d.%d detected.\n", major, minor);
+    /**************************************/
 
-    if(fileName) {
-        FirmwareFormat format = RAW;
-        buffer = readFirmware(fileName, &format);
-        if(!buffer) {
-            fprintf(stderr, "Error reading file \"%s\"\n", fileName);
+    options.fileName = fileName;
+    if(fileName && cacheDir) {
+        /* Parsing waits until a target misses the cache. */
+        options.cache = ImageCache_create(cacheDir);
+        success = options.cache != NULL;
+        if(!success) {
+            fprintf(stderr, "Unable to use cache directory \"%s\": %s.\n",
+                    cacheDir, stmLastErrorMessage());
             goto ExitApp;
         }
-        if(format == RAW) {
-            SparseBuffer_offset(buffer, devParams.flashBeginAddr);
-        }
-    }
-
-    if(erase) {
-        success = stmEraseAll();
+        success = stmIdentifyFirmware(fileName, &options.id);
         if(!success) {
-            fprintf(stderr, "Unable to erase flash.\n");
+            fprintf(stderr, "Error reading file \"%s\": %s.\n", fileName,
+                    stmLastErrorMessage());
             goto ExitApp;
         }
-    } else if(buffer) {
-        success = stmErase(buffer);
+    } else if(fileName) {
+        options.firmware = stmReadFirmware(fileName, &options.format,
+                FIRMWARE_MAP, NULL);
+        success = options.firmware != NULL;
         if(!success) {
-            fprintf(stderr, "Unable to erase flash.\n");
+            fprintf(stderr, "Error reading file \"%s\": %s.\n", fileName,
+                    stmLastErrorMessage());
             goto ExitApp;
         }
     }
 
-    if(buffer) {
-        success = stmWrite(buffer);
-        if(!success) {
-            fprintf(stderr, "Unable to write flash.\n");
-            goto ExitApp;
-        }
-        if(verify) {
-            success = stmVerify(buffer);
-            if(!success) {
-                fprintf(stderr, "Flash verification failed.\n");
-                goto ExitApp;
-            }
-        }
+    if(numTargets == 0) {
+        targets = calloc(1, sizeof(Target));
+        if(!targets) abort();
+        targets[0].devName = DEFAULT_DEV_NAME;
+        numTargets = 1;
     }
 
-    if(run) {
-        success = stmRun(devParams.flashBeginAddr);
-        if(!success) {
-            fprintf(stderr, "Unable to start firmware.\n");
-            goto ExitApp;
-        }
+    if(numTargets == 1) {
+        success = programTarget(&targets[0]);
+        if(targets[0].error[0]) fprintf(stderr, "%s\n", targets[0].error);
+    } else {
+        gangMode = true;
+        success = runGang(targets, numTargets);
     }
 
 ExitApp:
-    if(dev) serialClose(dev);
-    free(devName);
+    free(targets);
     free(fileName);
-    if(buffer) SparseBuffer_destroy(buffer);
+    while(plans) {
+        Plan *next = plans->next;
+        if(plans->cached) {
+            CachedImage_destroy(plans->cached);
+        } else {
+            free((uint8_t *)plans->pages);
+        }
+        free(plans);
+        plans = next;
+    }
+    if(options.firmware) SparseBuffer_destroy(options.firmware);
+    if(options.cache) ImageCache_destroy(options.cache);
     return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
@@ -227,386 +281,384 @@ static void printUsage(void) {
             "\n"
             "OPTIONS:\n"
             "  -b BAUD    Set the baud rate. (%d)\n"
+            "  -c DIR     Cache parsed and planned images in DIR.\n"
             "  -d DEVICE  Communicate using DEVICE. (%s)\n"
+            "             Repeat to program several devices in parallel.\n"
+            "  -D         Only erase and write pages that differ from FILE.\n"
             "  -e         Erase the target device.\n"
+            "  -f FORMAT  Read FILE as raw, ihex, srec or elf. (detect)\n"
+            "  -g USEC    Wait at least USEC between write blocks. (0)\n"
             "  -h         Print this help.\n"
+            "  -L         Reduce serial driver and adapter latency.\n"
+            "  -P DEPTH   Pipeline up to DEPTH write transactions.  Only for\n"
+            "             links that buffer input, not a bare USART. (1)\n"
             "  -r         Run the firmware on the device.\n"
             "  -v         Verify the write process.\n"
-            "  -w FILE    Write the raw binary FILE to the target device.\n"
+            "  -w FILE    Write FILE to the device.\n"
             "\n",
             DEFAULT_BAUD,
             DEFAULT_DEV_NAME);
 }
 
-static bool stmConnect(void) {
-    serialSetDtr(dev, true);
-    usleep(10000);
-    serialSetDtr(dev, false);
-    usleep(10000);
-
-    uint8_t data = 0x7F;
-    int retries = 0;
-    do {
-        if(++retries > MAX_RETRIES) return false;
-        (void)serialWrite(dev, &data, 1);
-    } while(!stmRecvAck());
-    return true;
-}
-
-static int cmdIndex(uint8_t cmd) {
-    int idx = -1;
-    switch(cmd) {
-    case CMD_GET_VERSION:     idx++;
-    case CMD_GET_READ_STATUS: idx++;
-    case CMD_GET_ID:          idx++;
-    case CMD_READ_MEM:        idx++;
-    case CMD_GO:              idx++;
-    case CMD_WRITE_MEM:       idx++;
-    case CMD_ERASE:           idx++;
-    case CMD_EXTENDED_ERASE:  idx++;
-    case CMD_WRITE_PROTECT:   idx++;
-    case CMD_WRITE_UNPROTECT: idx++;
-    case CMD_READ_PROTECT:    idx++;
-    case CMD_READ_UNPROTECT:  idx++;
-    default:                  break;
-    }
-    assert(idx < NUM_COMMANDS_KNOWN);
-    return idx;
+/** \brief Look up a firmware format by its name on the command line. */
+static bool parseFormat(const char *name, FirmwareFormat *format) {
+    static const struct {
+        const char *name;
+        FirmwareFormat format;
+    } FORMATS[] = {
+        { "raw", FIRMWARE_RAW },
+        { "ihex", FIRMWARE_IHEX },
+        { "srec", FIRMWARE_SREC },
+        { "elf", FIRMWARE_ELF }
+    };
+
+    for(size_t i = 0; i < sizeof(FORMATS) / sizeof(FORMATS[0]); ++i) {
+        if(!strcmp(name, FORMATS[i].name)) {
+            *format = FORMATS[i].format;
+            return true;
+        }
+    }
+    return false;
 }
 
-static bool cmdSupported(Command cmd) {
-    int idx = cmdIndex(cmd);
-    assert(idx >= 0);
-    return devParams.commands[idx];
-}
+static bool programTarget(Target *target) {
+    uint64_t start = stmSerialClock();
+    StmSession *session = NULL;
+    uint8_t *pages = NULL;
+    bool success = false;
+
+    setPhase(target, "connecting");
+    SerialDev *dev = stmSerialOpen(target->devName, options.baud);
+    if(!dev) {
+        fail(target, "Unable to open device: %s.", stmLastErrorMessage());
+        goto Done;
+    }
+    if(stmSerialGetBaud(dev) != options.baud) {
+        say("Using %d baud (%d requested).\n", stmSerialGetBaud(dev),
+                options.baud);
+    }
+    if(options.lowLatency) {
+        SerialLatency latency = stmSerialSetLowLatency(dev);
+        say("Low latency mode %s, ",
+                latency.lowLatency ? "enabled" : "unavailable");
+        if(latency.latencyTimer >= 0) {
+            say("adapter latency timer %d ms.\n", latency.latencyTimer);
+        } else {
+            say("no adapter latency timer.\n");
+        }
+    }
 
-static bool serialWrite16(const uint16_t data, uint8_t *checksum) {
-    uint8_t buffer[] = { ((data >> 8) & 0xFF), (data & 0xFF) };
-    *checksum ^= buffer[1];
-    *checksum ^= buffer[0];
-    return serialWrite(dev, buffer, sizeof(buffer));
-}
+    session = stmCreateSession(dev);
+    stmSetWriteGap(session, options.minWriteGap);
+    stmSetPipelineDepth(session, options.pipelineDepth);
+    stmSetProgress(session, showProgress, target);
 
-static bool stmRecvAck(void) {
-    uint8_t data = 0;
-    if(!serialRead(dev, &data, 1)) return false;
-    return data == ACK;
-}
+    if(!stmConnect(session)) {
+        fail(target, "STM32 not detected: %s.", stmGetErrorMessage(session));
+        goto Done;
+    }
 
-static bool stmSendByte(uint8_t byte) {
-    uint8_t buffer[] = { byte, ~byte };
-    if(!serialWrite(dev, buffer, sizeof(buffer))) return false;
-    return stmRecvAck();
-}
+    int code = stmGetDevParams(session);
+    if(code != true) {
+        fail(target, "Device not supported or error happened, code=%d: %s.",
+                code, stmGetErrorMessage(session));
+        goto Done;
+    }
+    int major = stmGetBootloaderVer(session) >> 4;
+    int minor = stmGetBootloaderVer(session) & 0x0F;
+    say("Bootloader version %d.%d detected.\n", major, minor);
+
+    const SparseBuffer *image = NULL;
+    const uint8_t *plan = NULL;
+    if(options.fileName) {
+        const Plan *planned = planFirmware(target, session);
+        if(!planned) goto Done;
+        image = planned->image;
+        plan = planned->pages;
+    }
 
-static bool stmSendAddr(uint32_t addr) {
-    assert(addr % 4 == 0);
-    uint8_t buffer[5] = { 0 };
-    for(int i = 0; i < 4; ++i) {
-        buffer[i] = (uint8_t)(addr >> ((3 - i) * CHAR_BIT));
-        buffer[4] ^= buffer[i];
+    if(options.diff) {
+        /* The shared plan covers every page of the image; narrow down a
+         * copy to the pages that differ on this target. */
+        size_t count = stmDevicePageCount(stmGetDevice(session));
+        pages = malloc(count);
+        if(!pages) abort();
+        plan = pages;
+        if(!stmDiffPages(session, image, pages)) {
+            fail(target, "Unable to read flash: %s.",
+                    stmGetErrorMessage(session));
+            goto Done;
+        }
+        size_t changed = 0;
+        for(size_t page = 0; page < count; ++page) changed += pages[page];
+        say("%zu page(s) differ.\n", changed);
     }
-    if(!serialWrite(dev, buffer, sizeof(buffer))) return false;
-    return stmRecvAck();
-}
 
-static bool stmSendBlock(const uint8_t *buffer, size_t size) {
-    assert(size > 0 && size <= MAX_BLOCK_SIZE);
-    size_t padding = (4 - (size % 4)) % 4;
-    uint8_t n = size + padding - 1;
-    uint8_t checksum = n;
-    for(size_t i = 0; i < size; ++i) checksum ^= buffer[i];
-    if(!serialWrite(dev, &n, 1)) return false;
-    if(!serialWrite(dev, buffer, size)) return false;
-    for(size_t i = 0; i < padding; ++i) {
-        uint8_t data = 0xFF;
-        checksum ^= data;
-        if(!serialWrite(dev, &data, 1)) return false;
-    }
-    if(!serialWrite(dev, &checksum, 1)) return false;
-    return stmRecvAck();
-}
+    if(options.erase) {
+        if(!stmEraseAll(session)) {
+            fail(target, "Unable to erase flash: %s.",
+                    stmGetErrorMessage(session));
+            goto Done;
+        }
+    } else if(image) {
+        if(!stmErase(session, plan)) {
+            fail(target, "Unable to erase flash: %s.",
+                    stmGetErrorMessage(session));
+            goto Done;
+        }
+    }
 
-static int stmGetDevParams(void) {
-    uint8_t data = 0;
-
-    devParams.flashBeginAddr = 0x08000000;
-    devParams.flashEndAddr = 0x08008000;
-    devParams.flashPagesPerSector = 4;
-    devParams.flashPageSize = 1024;
-    devParams.eraseDelay = 40000;
-    devParams.writeDelay = 80000;
-
-    if(!stmSendByte(CMD_GET_VERSION)) return -1;
-    if(!serialRead(dev, &data, 1)) return -2;
-    if(!serialRead(dev, &devParams.bootloaderVer, 1)) return -3;
-    for(int i = 0; i < NUM_COMMANDS_KNOWN; ++i) devParams.commands[i] = false;
-    for(int i = data; i > 0; --i) {
-        if(!serialRead(dev, &data, 1)) return -4;
-        int idx = cmdIndex(data);
-        if(idx >= 0) devParams.commands[idx] = true;
-    }
-    if(!stmRecvAck()) return -5;
-
-    if(!cmdSupported(CMD_GET_ID)) {
-        fprintf(stderr, "Target device does not support GET_ID command.\n");
-        return -6;
-    }
-    if(!stmSendByte(CMD_GET_ID)) return -7;
-    if(!serialRead(dev, &data, 1)) return -8;
-    if(data != 1) return -9;
-    uint16_t id = 0;
-    for(int i = data; i >= 0; --i) {
-        if(!serialRead(dev, &data, 1)) return -10;
-        if(i < 2) {
-            id |= data << (i * CHAR_BIT);
+    if(image) {
+        const uint8_t *writePages = options.diff ? plan : NULL;
+        if(!stmWrite(session, image, writePages)) {
+            fail(target, "Unable to write flash: %s.",
+                    stmGetErrorMessage(session));
+            goto Done;
+        }
+        if(options.verify && !stmVerify(session, image)) {
+            fail(target, "Flash verification failed: %s.",
+                    stmGetErrorMessage(session));
+            goto Done;
         }
     }
-    if(!stmRecvAck()) return -11;
-    switch(id) {
-    case ID_LOW_DENSITY:
-        devParams.flashEndAddr = 0x08008000;
-        break;
-    case ID_MED_DENSITY:
-        devParams.flashEndAddr = 0x08020000;
-        break;
-    case ID_HI_DENSITY:
-        devParams.flashEndAddr = 0x08080000;
-        devParams.flashPagesPerSector = 2;
-        devParams.flashPageSize = 2048;
-        break;
-    case ID_CONNECTIVITY:
-        devParams.flashEndAddr = 0x08040000;
-        devParams.flashPagesPerSector = 2;
-        devParams.flashPageSize = 2048;
-        break;
-    case ID_MED_DENSITY_VALUE:
-        devParams.flashEndAddr = 0x08020000;
-        break;
-    case ID_HI_DENSITY_VALUE:
-        devParams.flashEndAddr = 0x08080000;
-        devParams.flashPagesPerSector = 2;
-        devParams.flashPageSize = 2048;
-        break;
-    case ID_XL_DENSITY:
-        devParams.flashEndAddr = 0x08100000;
-        devParams.flashPagesPerSector = 2;
-        devParams.flashPageSize = 2048;
-        break;
-    case ID_MED_DENSITY_ULTRA_LOW_POWER:
-        devParams.flashEndAddr = 0x08060000;
-        devParams.flashPagesPerSector = 16;
-        devParams.flashPageSize = 256;
-        break;
-    case ID_HI_DENSITY_ULTRA_LOW_POWER:
-        devParams.flashEndAddr = 0x08020000;
-        devParams.flashPagesPerSector = 16;
-        devParams.flashPageSize = 256;
-        break;
-    case 0x438: /* STM32F303x4(6/8)/334xx/328xx */
-        devParams.flashEndAddr = 0x08010000;
-        devParams.flashPagesPerSector = 1;
-        devParams.flashPageSize = 2048;
-        break;
-    case 0x440: /* STM32F051*/
-        devParams.flashEndAddr = 0x08010000;
-        devParams.flashPagesPerSector = 4;
-        devParams.flashPageSize = 1024;
-        break;
-    case 0x411: /* STM32F205*/
-        devParams.flashEndAddr = 0x08100000;
-	// Everything's very poorly specified. Hope this works:
-        devParams.flashPagesPerSector = 1; // There are no pages at all in STM32F205
-        devParams.flashPageSize = 16384;   // Reference manual defines a sector as a smallest erasable unit, so it should work like a "page".
-	// Sectors are not all the same size, I use the smallest sector size here.
-        break;
-    case 0x451: /* STM32F765*/
-        devParams.flashEndAddr = 0x08200000;
-        // Everything's very poorly specified. Hope this works:
-	// The flash works differently in "single bank" or "dual bank" modes. No idea which the bootloader uses, assuming single bank.
-        devParams.flashPagesPerSector = 1; // There are no pages at all in STM32F765
-        devParams.flashPageSize = 32768;   // Reference manual defines a sector as a smallest erasable unit, so it should work like a "page".
-        // Sectors are not all the same size, I use the smallest sector size here.
-        break;
-
-    case 0x450: /* STM32H743*/
-        devParams.flashEndAddr = 0x08200000;
-        devParams.flashPagesPerSector = 1; // There are no pages at all in STM32H743
-        devParams.flashPageSize = 128*1024;   // Reference manual defines a sector as a smallest erasable unit, so it should work like a "page".
-        // Sectors are all the same size! Hooray!
-        break;
-
-
-
-    default:
-        fprintf(stderr, "Target device ID 0x%x is unsupported.\n", id);
-        return -12;
+
+    if(options.run) {
+        setPhase(target, "starting");
+        if(!stmRun(session, stmGetFlashBegin(session))) {
+            fail(target, "Unable to start firmware: %s.",
+                    stmGetErrorMessage(session));
+            goto Done;
+        }
     }
 
-    return true;
+    success = true;
+
+Done:
+    if(session) stmDestroySession(session);
+    if(dev) stmSerialClose(dev);
+    free(pages);
+    target->elapsed = stmSerialClock() - start;
+    return success;
 }
 
-static bool stmErasePages(uint16_t first, uint16_t count) {
-    if(count == 0) return true;
+static void *gangWorker(void *arg) {
+    Target *target = arg;
 
-    if(cmdSupported(CMD_ERASE)) {
-        if(first > 255 || first + count - 1 > 255) return false;
+    bool ok = programTarget(target);
 
-        if(!stmSendByte(CMD_ERASE)) return false;
-        uint8_t data = count - 1;
-        uint8_t checksum = data;
-        if(!serialWrite(dev, &data, 1)) return false;
-        for(data = first; data < first + count; ++data) {
-            checksum ^= data;
-            if(!serialWrite(dev, &data, 1)) return false;
-        }
-        if(!serialWrite(dev, &checksum, 1)) return false;
-    } else if(cmdSupported(CMD_EXTENDED_ERASE)) {
-        if(count > 0xFFF0) return false;
-
-        if(!stmSendByte(CMD_EXTENDED_ERASE)) return false;
-        uint8_t checksum = 0;
-        if(!serialWrite16(count - 1, &checksum)) return false;
-        for(uint16_t i = first; i < first + count; ++i) {
-            if(!serialWrite16(i, &checksum)) return false;
-        }
-        if(!serialWrite(dev, &checksum, 1)) return false;
-    } else {
-        fprintf(stderr,
-                "Target device does not support known erase commands.\n");
-        return false;
-    }
-
-    return stmRecvAck();
+    pthread_mutex_lock(&gangLock);
+    target->phase = ok ? "done" : "failed";
+    target->done = true;
+    pthread_mutex_unlock(&gangLock);
+    return NULL;
 }
 
-static bool stmEraseAll(void) {
-    if(cmdSupported(CMD_ERASE)) {
-        if(!stmSendByte(CMD_ERASE)) return false;
-        uint8_t data[] = { 0xFF, 0x00 };
-        if(!serialWrite(dev, data, sizeof(data))) return false;
-    } else if(cmdSupported(CMD_EXTENDED_ERASE)) {
-        if(!stmSendByte(CMD_EXTENDED_ERASE)) return false;
-        uint8_t data[] = { 0xFF, 0xFF, 0x00 };
-        if(!serialWrite(dev, data, sizeof(data))) return false;
-    } else {
-        fprintf(stderr,
-                "Target device does not support known erase commands.\n");
-        return false;
+static bool runGang(Target *targets, size_t count) {
+    size_t started;
+    for(started = 0; started < count; ++started) {
+        Target *target = &targets[started];
+        if(pthread_create(&target->thread, NULL, gangWorker, target) != 0) {
+            break;
+        }
+    }
+    for(size_t i = started; i < count; ++i) {
+        fail(&targets[i], "Unable to start a thread.");
+        targets[i].phase = "failed";
+        targets[i].done = true;
     }
 
-    if(stmRecvAck()) {
-        useconds_t delay = (devParams.eraseDelay / 100) + 1;
-        printf("Erasing:\n");
-        for(int i = 1; i <= 100; ++i) {
-            usleep(delay);
-            printProgressBar(i);
+    /* Report phase changes as they happen, below which a status line shows
+     * the progress of every target within its current phase. */
+    const char **shown = calloc(count, sizeof(const char *));
+    if(!shown) abort();
+    bool running = true;
+    while(running) {
+        usleep(PROGRESS_INTERVAL);
+        running = false;
+        pthread_mutex_lock(&gangLock);
+        printf("\r%*s\r", (int)(5 * count), "");
+        for(size_t i = 0; i < count; ++i) {
+            if(targets[i].phase != shown[i]) {
+                printf("%s: %s\n", targets[i].devName, targets[i].phase);
+                shown[i] = targets[i].phase;
+            }
+            if(!targets[i].done) running = true;
         }
-        printf("\n");
-    } else {
-        // Global erase failed, try page-by-page erase.
-        uint16_t numPages =
-                (devParams.flashEndAddr - devParams.flashBeginAddr) /
-                devParams.flashPageSize;
-        printf("Erasing (page-by-page erase due to failed global erase)...\n");
-        return stmErasePages(0, numPages);
+        for(size_t i = 0; i < count; ++i) {
+            printf("%4d%%", targets[i].percent);
+        }
+        pthread_mutex_unlock(&gangLock);
+        fflush(stdout);
+    }
+    printf("\n");
+    free(shown);
+
+    for(size_t i = 0; i < started; ++i) {
+        (void)pthread_join(targets[i].thread, NULL);
     }
 
+    printSummary(targets, count);
+    for(size_t i = 0; i < count; ++i) {
+        if(targets[i].error[0]) return false;
+    }
     return true;
 }
 
-static bool stmWriteBlock(uint32_t addr, const uint8_t *buff, size_t size) {
-    if(!stmSendByte(CMD_WRITE_MEM)) return false;
-    if(!stmSendAddr(addr)) return false;
-    if(!stmSendBlock(buff, size)) return false;
-    return true;
+static void printSummary(const Target *targets, size_t count) {
+    size_t succeeded = 0;
+
+    printf("Summary:\n");
+    for(size_t i = 0; i < count; ++i) {
+        const Target *target = &targets[i];
+        bool ok = !target->error[0];
+        printf("  %-20s %-6s %6.1f s  %s\n", target->devName,
+                ok ? "OK" : "FAILED", target->elapsed / 1e6, target->error);
+        if(ok) succeeded++;
+    }
+    printf("%zu of %zu targets succeeded.\n", succeeded, count);
 }
 
-static bool stmReadBlock(uint32_t addr, uint8_t *buff, size_t size) {
-    if(!stmSendByte(CMD_READ_MEM)) return false;
-    if(!stmSendAddr(addr)) return false;
-    if(!stmSendByte(size - 1)) return false;
-    return serialRead(dev, buff, size);
+static void fail(Target *target, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(target->error, sizeof(target->error), format, args);
+    va_end(args);
 }
 
-static bool stmErase(SparseBuffer *buffer) {
-    printf("Erasing...\n");
-
-    MemBlock block;
-    bool ok = true;
-
-    SparseBuffer_rewind(buffer);
-    while(ok && (block = SparseBuffer_read(buffer, 0)).data) {
-        size_t lastAddr = block.offset + block.length - 1;
-        uint16_t start = (block.offset - devParams.flashBeginAddr) /
-                devParams.flashPageSize;
-        uint16_t end = (lastAddr - devParams.flashBeginAddr) /
-                devParams.flashPageSize;
-        if(start > end) {
-            return false;
-        }
-        ok = stmErasePages(start, 1 + end - start);
-    }
+static void say(const char *format, ...) {
+    /* Gang targets report through their phase and progress instead. */
+    if(gangMode) return;
 
-    return ok;
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
 }
 
-static bool stmWrite(SparseBuffer *buffer) {
-    if(!cmdSupported(CMD_WRITE_MEM)) {
-        fprintf(stderr,
-                "Target device does not support known write commands.\n");
-        return false;
-    }
+static void setPhase(Target *target, const char *phase) {
+    if(!gangMode) return;
 
-    printf("Writing:\n");
+    pthread_mutex_lock(&gangLock);
+    target->phase = phase;
+    target->percent = 0;
+    pthread_mutex_unlock(&gangLock);
+}
 
-    size_t bufferSize = SparseBuffer_size(buffer);
-    MemBlock block;
-    long bytesWritten = 0;
-    bool ok = true;
+static const Plan *planFirmware(Target *target, StmSession *session) {
+    const DeviceInfo *device = stmGetDevice(session);
+    uint32_t flashBegin = stmGetFlashBegin(session);
+    size_t numPages = stmDevicePageCount(device);
 
-    SparseBuffer_rewind(buffer);
-    while(ok && (block = SparseBuffer_read(buffer, MAX_BLOCK_SIZE)).data) {
-        ok = stmWriteBlock(block.offset, block.data, block.length);
-        usleep(devParams.writeDelay);
-        bytesWritten += block.length;
-        printProgressBar(bytesWritten * 100 / bufferSize);
-    }
+    pthread_mutex_lock(&gangLock);
 
-    printf("\n");
-    return ok;
-}
+    Plan *plan = plans;
+    while(plan && plan->device != device) plan = plan->next;
+    if(plan) goto Unlock;
 
-static bool stmVerify(SparseBuffer *buffer) {
-    if(!cmdSupported(CMD_READ_MEM)) {
-        fprintf(stderr,
-                "Target device does not support known read commands.\n");
-        return false;
+    CachedImage *cached = NULL;
+    if(options.cache) {
+        cached = ImageCache_load(options.cache, &options.id, device->id);
+        if(!cached && stmLastError() == STM_ERROR_FORMAT) {
+            say("Ignoring cache: %s.\n", stmLastErrorMessage());
+        }
+    }
+    /* An image cached from a file parsed differently does not count. */
+    if(cached && options.format != FIRMWARE_AUTO
+            && CachedImage_format(cached) != options.format) {
+        CachedImage_destroy(cached);
+        cached = NULL;
+    }
+    if(cached) {
+        size_t count;
+        const uint8_t *pages = CachedImage_pages(cached, &count);
+        if(count == numPages) {
+            plan = malloc(sizeof(Plan));
+            if(!plan) abort();
+            plan->image = CachedImage_buffer(cached);
+            plan->pages = pages;
+            plan->cached = cached;
+            goto Found;
+        }
+        CachedImage_destroy(cached);
     }
 
-    printf("Verifying:\n");
-
-    size_t bufferSize = SparseBuffer_size(buffer);
-    MemBlock block;
-    uint8_t firmwareBuff[MAX_BLOCK_SIZE];
-    long bytesRead = 0;
-    bool ok = true;
+    if(!options.firmware) {
+        /* The image is stored in the cache under the identity looked up,
+         * so it must be the same file. */
+        FirmwareId id;
+        options.firmware = stmReadFirmware(options.fileName, &options.format,
+                FIRMWARE_MAP, &id);
+        if(!options.firmware) {
+            fail(target, "Error reading file \"%s\": %s.", options.fileName,
+                    stmLastErrorMessage());
+            goto Unlock;
+        }
+        if(id.size != options.id.size
+                || memcmp(id.digest, options.id.digest, sizeof(id.digest))) {
+            SparseBuffer_destroy(options.firmware);
+            options.firmware = NULL;
+            fail(target, "File \"%s\" changed while it was read.",
+                    options.fileName);
+            goto Unlock;
+        }
+    }
 
-    SparseBuffer_rewind(buffer);
-    while(ok && (block = SparseBuffer_read(buffer, MAX_BLOCK_SIZE)).data) {
-        ok = stmReadBlock(block.offset, firmwareBuff, block.length);
-        if(ok) ok = (memcmp(block.data, firmwareBuff, block.length) == 0);
-        bytesRead += block.length;
-        printProgressBar(bytesRead * 100 / bufferSize);
+    /* Raw images start at the beginning of flash.  The first target to get
+     * here places the image; from then on it is read-only. */
+    if(!firmwarePlaced) {
+        if(options.format == FIRMWARE_RAW) {
+            SparseBuffer_offset(options.firmware, flashBegin);
+        }
+        firmwareBase = flashBegin;
+        firmwarePlaced = true;
+    }
+    if(options.format == FIRMWARE_RAW && firmwareBase != flashBegin) {
+        fail(target, "Flash begins at 0x%08x, not at 0x%08x.",
+                flashBegin, firmwareBase);
+        goto Unlock;
     }
 
-    printf("\n");
-    return ok;
+    uint8_t *map = stmMapPages(session, options.firmware);
+    if(!map) {
+        fail(target, "Firmware does not fit in flash memory: %s.",
+                stmGetErrorMessage(session));
+        goto Unlock;
+    }
+    if(options.cache && !ImageCache_store(options.cache, &options.id,
+            device->id, options.format, options.firmware, map, numPages)) {
+        say("Not cached: %s.\n", stmLastErrorMessage());
+    }
+    plan = malloc(sizeof(Plan));
+    if(!plan) abort();
+    plan->image = options.firmware;
+    plan->pages = map;
+    plan->cached = NULL;
+
+Found:
+    plan->device = device;
+    plan->next = plans;
+    plans = plan;
+
+Unlock:
+    pthread_mutex_unlock(&gangLock);
+    return plan;
 }
 
-static bool stmRun(uint32_t addr) {
-    if(!stmSendByte(CMD_GO)) return false;
-    return stmSendAddr(addr);
+static void showProgress(StmSession *session, StmStep step, int percent) {
+    Target *target = stmGetUser(session);
+
+    if(gangMode) {
+        pthread_mutex_lock(&gangLock);
+        target->phase = STEP_NAMES[step];
+        if(percent != STM_STEP_DONE) target->percent = percent;
+        pthread_mutex_unlock(&gangLock);
+    } else if(percent == 0) {
+        printf("%s:\n", STEP_TITLES[step]);
+    } else if(percent == STM_STEP_DONE) {
+        printf("\n");
+    } else {
+        printProgressBar(percent);
+    }
 }
 
 static void printProgressBar(int percent) {
@@ -618,4 +670,3 @@ static void printProgressBar(int percent) {
     printf("]");
     fflush(stdout);
 }
-
@@ -0,0 +1,802 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "devices.h"
+#include "firmware.h"
+#include "image-cache.h"
+#include "serial.h"
+#include "stm32.h"
+
+/** The socket's name in $XDG_RUNTIME_DIR, or in /tmp without it. */
+static const char *DEFAULT_SOCKET_BASE = "stm32sprogd.sock";
+static const int DEFAULT_BAUD = 115200;
+/** Number of parsed images kept while no job uses them. */
+static const size_t MAX_CACHED_IMAGES = 8;
+/** Longest request line accepted, including the newline. */
+#define MAX_REQUEST 1024
+/** Most -a options accepted. */
+#define MAX_ALLOWED_DEVICES 16
+
+/** A programming job, as requested by a client. */
+typedef struct {
+    unsigned long id;
+    const char *devName;
+    const char *fileName;
+    int baud;
+    bool diff;
+    bool erase;
+    bool verify;
+    bool run;
+    int pipelineDepth;
+} Job;
+
+/** A client connection and the job it is running. */
+typedef struct {
+    int fd;
+    const Job *job;
+    /** The reason the job failed, or empty on success. */
+    char error[256];
+} Client;
+
+/** A serial device kept open between jobs. */
+typedef struct Port Port;
+struct Port {
+    Port *next;
+    char *name;
+    /** The open device, or NULL if the next job must open it. */
+    SerialDev *dev;
+    int baud;
+    /** Jobs take tickets and run in the order they arrived. */
+    unsigned long nextTicket;
+    unsigned long serving;
+    pthread_cond_t turn;
+};
+
+/** The page map of an image for one device layout. */
+typedef struct PagePlan PagePlan;
+struct PagePlan {
+    PagePlan *next;
+    const DeviceInfo *device;
+    uint8_t *pages;
+};
+
+/** A parsed firmware image, found by the digest of the file contents. */
+typedef struct Image Image;
+struct Image {
+    Image *next;
+    FirmwareId id;
+    FirmwareFormat format;
+    /** Where a raw image was placed; 0 for other formats. */
+    uint32_t base;
+    const SparseBuffer *buffer;
+    /** The owner of the buffer: either the parsed image or the on-disk cache
+     * entry it was loaded from. */
+    SparseBuffer *parsed;
+    CachedImage *stored;
+    /** The device type of the on-disk cache entry. */
+    uint16_t storedId;
+    PagePlan *plans;
+    /** Number of jobs using the image.  Unused images may be evicted. */
+    unsigned users;
+    uint64_t lastUsed;
+};
+
+static void printUsage(void);
+static void onSignal(int sig);
+
+static void *serveClient(void *arg);
+static void handleRequest(int fd, char *request);
+static bool parseJob(Job *job, char *request, char *error, size_t size);
+static bool deviceAllowed(const char *devName);
+static bool runJob(Client *client, Port *port, StmStats *stats,
+        bool *cached);
+
+static Port *queuePort(const char *name, unsigned long *ticket);
+static void waitTurn(Port *port, unsigned long ticket);
+static void releasePort(Port *port);
+
+static Image *acquireImage(const char *fileName, uint32_t flashBegin,
+        uint16_t deviceId, bool *cached);
+static Image *loadImage(const char *fileName, const FirmwareId *id,
+        uint32_t flashBegin, uint16_t deviceId);
+static void releaseImage(Image *image);
+static const uint8_t *planImage(Image *image, StmSession *session);
+static void evictImages(void);
+
+static void reply(int fd, const char *format, ...);
+static void fail(Client *client, const char *format, ...);
+static void showProgress(StmSession *session, StmStep step, int percent);
+
+/** Names of the steps in progress messages. */
+static const char *const STEP_NAMES[] = {
+    [STM_COMPARE] = "comparing",
+    [STM_ERASE] = "erasing",
+    [STM_WRITE] = "writing",
+    [STM_VERIFY] = "verifying"
+};
+
+static int defaultBaud;
+/** The on-disk cache of planned images, or NULL. */
+static ImageCache *diskCache = NULL;
+/** The deepest write pipeline a job may ask for.  Only raised for links
+ * that buffer the bootloader's input. */
+static int maxPipelineDepth = 1;
+static bool lowLatency = false;
+/** Name prefixes of the devices jobs may use.  Serial devices and TCP
+ * bridges unless -a is given; never files, which the record and replay
+ * transports would write and read. */
+static const char *allowedDevices[MAX_ALLOWED_DEVICES] = { "/dev/", "tcp:" };
+static size_t numAllowedDevices = 2;
+static volatile sig_atomic_t stopping = 0;
+
+/** Guards the port list and the ports' queues. */
+static pthread_mutex_t portLock = PTHREAD_MUTEX_INITIALIZER;
+static Port *ports = NULL;
+
+/** Guards the image cache. */
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static Image *images = NULL;
+static size_t numImages = 0;
+
+static pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long lastJobId = 0;
+
+int main(int argc, char **argv) {
+    int opt;
+    const char *socketName = NULL;
+    bool allowGiven = false;
+
+    defaultBaud = DEFAULT_BAUD;
+
+    while((opt = getopt(argc, argv, "a:b:c:hLP:s:")) != -1) {
+        switch(opt) {
+        case 'a':
+            if(!allowGiven) numAllowedDevices = 0;
+            allowGiven = true;
+            if(numAllowedDevices == MAX_ALLOWED_DEVICES) {
+                fprintf(stderr, "Too many -a options.\n");
+                return EXIT_FAILURE;
+            }
+            allowedDevices[numAllowedDevices++] = optarg;
+            break;
+        case 'b':
+            defaultBaud = atoi(optarg);
+            break;
+        case 'c':
+            if(diskCache) ImageCache_destroy(diskCache);
+            diskCache = ImageCache_create(optarg);
+            if(!diskCache) {
+                fprintf(stderr, "Unable to use cache directory \"%s\": %s.\n",
+                        optarg, stmLastErrorMessage());
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'L':
+            lowLatency = true;
+            break;
+        case 'P':
+            maxPipelineDepth = atoi(optarg);
+            if(maxPipelineDepth < 1) maxPipelineDepth = 1;
+            if(maxPipelineDepth > STM_MAX_PIPELINE_DEPTH) {
+                maxPipelineDepth = STM_MAX_PIPELINE_DEPTH;
+            }
+            break;
+        case 's':
+            socketName = optarg;
+            break;
+        case 'h':
+        default:
+            printUsage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    char defaultSocketName[PATH_MAX];
+    if(!socketName) {
+        const char *dir = getenv("XDG_RUNTIME_DIR");
+        snprintf(defaultSocketName, sizeof(defaultSocketName), "%s/%s",
+                dir && *dir ? dir : "/tmp", DEFAULT_SOCKET_BASE);
+        socketName = defaultSocketName;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socketName) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket name \"%s\" is too long.\n", socketName);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, socketName);
+
+    /* Only the daemon's user may connect, whatever the umask.  Others
+     * are let in by changing the socket's owner or mode. */
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    (void)unlink(socketName);
+    mode_t mask = umask(0077);
+    bool bound = listener != -1
+            && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if(!bound || listen(listener, 16) == -1) {
+        fprintf(stderr, "Unable to listen on \"%s\": %s\n", socketName,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* Without SA_RESTART, a signal interrupts accept() so that the socket
+     * gets removed.  Clients that go away must not kill the daemon. */
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    (void)sigaction(SIGINT, &action, NULL);
+    (void)sigaction(SIGTERM, &action, NULL);
+    (void)signal(SIGPIPE, SIG_IGN);
+
+    printf("Listening on %s\n", socketName);
+    fflush(stdout);
+
+    while(!stopping) {
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if(fd == -1) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "Unable to accept connection: %s\n",
+                    strerror(errno));
+            break;
+        }
+
+        /* Client threads inherit a mask that leaves the signals to this
+         * thread. */
+        pthread_t thread;
+        sigset_t mask, old;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &mask, &old);
+        int rc = pthread_create(&thread, NULL, serveClient,
+                (void *)(intptr_t)fd);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if(rc != 0) {
+            fprintf(stderr, "Unable to start client thread.\n");
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    (void)unlink(socketName);
+    close(listener);
+    return EXIT_SUCCESS;
+}
+
+static void printUsage(void) {
+    fprintf(stderr,
+            "Usage: stm32sprogd [OPTIONS]\n"
+            "\n"
+            "OPTIONS:\n"
+            "  -a PREFIX  Only program devices whose names start with PREFIX.\n"
+            "             May be repeated. (/dev/ and tcp:)\n"
+            "  -b BAUD    Default baud rate. (%d)\n"
+            "  -c DIR     Keep parsed and planned images in DIR.\n"
+            "  -h         Print this help.\n"
+            "  -L         Put serial adapters in low latency mode.\n"
+            "  -P DEPTH   Let jobs pipeline up to DEPTH write transactions.\n"
+            "             Only for links that buffer input. (1)\n"
+            "  -s SOCKET  Listen on SOCKET, which only the daemon's user may\n"
+            "             use. ($XDG_RUNTIME_DIR/%s or /tmp/%s)\n"
+            "\n"
+            "Each line sent to the socket requests a job:\n"
+            "\n"
+            "  program dev=DEVICE file=FILE [baud=BAUD] [depth=DEPTH]\n"
+            "          [diff] [erase] [verify] [run]\n"
+            "\n"
+            "The daemon answers with \"queued\" and \"progress\" lines and\n"
+            "ends each job with a \"done\" line.\n",
+            DEFAULT_BAUD, DEFAULT_SOCKET_BASE, DEFAULT_SOCKET_BASE);
+}
+
+static void onSignal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static void *serveClient(void *arg) {
+    int fd = (intptr_t)arg;
+    char request[MAX_REQUEST];
+    size_t length = 0;
+
+    for(;;) {
+        ssize_t n = read(fd, request + length, sizeof(request) - length - 1);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) break;
+        length += n;
+        request[length] = '\0';
+
+        char *line = request;
+        char *end;
+        while((end = strchr(line, '\n'))) {
+            *end = '\0';
+            handleRequest(fd, line);
+            line = end + 1;
+        }
+        length -= line - request;
+        memmove(request, line, length);
+        if(length == sizeof(request) - 1) {
+            reply(fd, "error message=Request too long.\n");
+            break;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void handleRequest(int fd, char *request) {
+    char *save = NULL;
+    char *verb = strtok_r(request, " \t\r", &save);
+    if(!verb) return;
+
+    if(strcmp(verb, "program")) {
+        reply(fd, "error message=Unknown request \"%s\".\n", verb);
+        return;
+    }
+
+    Job job;
+    Client client = { .fd = fd, .job = &job, .error = "" };
+
+    pthread_mutex_lock(&jobLock);
+    job.id = ++lastJobId;
+    pthread_mutex_unlock(&jobLock);
+
+    if(!parseJob(&job, strtok_r(NULL, "", &save), client.error,
+            sizeof(client.error))) {
+        reply(fd, "done job=%lu status=failed error=%s\n", job.id,
+                client.error);
+        return;
+    }
+
+    unsigned long ticket;
+    Port *port = queuePort(job.devName, &ticket);
+    pthread_mutex_lock(&portLock);
+    unsigned long position = ticket - port->serving;
+    pthread_mutex_unlock(&portLock);
+    reply(fd, "queued job=%lu position=%lu\n", job.id, position);
+
+    waitTurn(port, ticket);
+    uint64_t start = stmSerialClock();
+    StmStats stats;
+    memset(&stats, 0, sizeof(stats));
+    bool cached = false;
+    bool success = runJob(&client, port, &stats, &cached);
+    releasePort(port);
+    uint64_t elapsed = (stmSerialClock() - start) / 1000;
+
+    printf("Job %lu on %s: %s (%llu ms)\n", job.id, job.devName,
+            success ? "done" : client.error, (unsigned long long)elapsed);
+    fflush(stdout);
+
+    /* The error message runs to the end of the line, so it comes last. */
+    reply(fd, "done job=%lu status=%s elapsed_ms=%llu cached=%d "
+            "written=%lu skipped=%lu read=%lu erased=%lu retries=%lu%s%s\n",
+            job.id, success ? "ok" : "failed", (unsigned long long)elapsed,
+            cached, stats.bytesWritten, stats.bytesSkipped, stats.bytesRead,
+            stats.pagesErased, stats.retries, success ? "" : " error=",
+            client.error);
+}
+
+static bool parseJob(Job *job, char *request, char *error, size_t size) {
+    job->devName = NULL;
+    job->fileName = NULL;
+    job->baud = defaultBaud;
+    job->diff = false;
+    job->erase = false;
+    job->verify = false;
+    job->run = false;
+    job->pipelineDepth = 1;
+
+    char *save = NULL;
+    for(char *arg = strtok_r(request, " \t\r", &save); arg;
+            arg = strtok_r(NULL, " \t\r", &save)) {
+        char *value = strchr(arg, '=');
+        if(value) *value++ = '\0';
+
+        if(value && !strcmp(arg, "dev")) {
+            job->devName = value;
+        } else if(value && !strcmp(arg, "file")) {
+            job->fileName = value;
+        } else if(value && !strcmp(arg, "baud")) {
+            job->baud = atoi(value);
+        } else if(value && !strcmp(arg, "depth")) {
+            job->pipelineDepth = atoi(value);
+        } else if(!value && !strcmp(arg, "diff")) {
+            job->diff = true;
+        } else if(!value && !strcmp(arg, "erase")) {
+            job->erase = true;
+        } else if(!value && !strcmp(arg, "verify")) {
+            job->verify = true;
+        } else if(!value && !strcmp(arg, "run")) {
+            job->run = true;
+        } else {
+            snprintf(error, size, "Unknown argument \"%s\".", arg);
+            return false;
+        }
+    }
+
+    if(!job->devName) {
+        snprintf(error, size, "No device given.");
+        return false;
+    }
+    if(!deviceAllowed(job->devName)) {
+        snprintf(error, size, "Device \"%s\" is not allowed.",
+                job->devName);
+        return false;
+    }
+    if(job->diff && !job->fileName) {
+        snprintf(error, size, "Nothing to compare without a file.");
+        return false;
+    }
+    if(job->diff && job->erase) {
+        snprintf(error, size, "Differential write requires write without "
+                "erase.");
+        return false;
+    }
+    if(job->pipelineDepth < 1) job->pipelineDepth = 1;
+    if(job->pipelineDepth > maxPipelineDepth) {
+        job->pipelineDepth = maxPipelineDepth;
+    }
+    return true;
+}
+
+static bool deviceAllowed(const char *devName) {
+    /* Paths that climb out of an allowed directory are not in it. */
+    if(strstr(devName, "/../")) return false;
+    for(size_t i = 0; i < numAllowedDevices; ++i) {
+        if(!strncmp(devName, allowedDevices[i], strlen(allowedDevices[i]))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool runJob(Client *client, Port *port, StmStats *stats,
+        bool *cached) {
+    const Job *job = client->job;
+    StmSession *session = NULL;
+    Image *image = NULL;
+    uint8_t *pages = NULL;
+    bool success = false;
+
+    reply(client->fd, "progress job=%lu step=connecting percent=0\n",
+            job->id);
+
+    /* The port stays open between jobs unless a job needs another baud
+     * rate or fails, in which case the device may have gone away. */
+    if(port->dev && port->baud != job->baud) {
+        stmSerialClose(port->dev);
+        port->dev = NULL;
+    }
+    if(!port->dev) {
+        port->dev = stmSerialOpen(port->name, job->baud);
+        if(!port->dev) {
+            fail(client, "Unable to open device: %s.",
+                    stmLastErrorMessage());
+            return false;
+        }
+        port->baud = job->baud;
+        if(lowLatency) (void)stmSerialSetLowLatency(port->dev);
+    }
+
+    session = stmCreateSession(port->dev);
+    stmSetPipelineDepth(session, job->pipelineDepth);
+    stmSetProgress(session, showProgress, client);
+
+    if(!stmConnect(session)) {
+        fail(client, "STM32 not detected: %s.", stmGetErrorMessage(session));
+        goto Done;
+    }
+
+    int code = stmGetDevParams(session);
+    if(code != true) {
+        fail(client, "Device not supported or error happened, code=%d: %s.",
+                code, stmGetErrorMessage(session));
+        goto Done;
+    }
+
+    const uint8_t *plan = NULL;
+    if(job->fileName) {
+        image = acquireImage(job->fileName, stmGetFlashBegin(session),
+                stmGetDevice(session)->id, cached);
+        if(!image) {
+            fail(client, "Unable to read \"%s\": %s.", job->fileName,
+                    stmLastErrorMessage());
+            goto Done;
+        }
+        plan = planImage(image, session);
+        if(!plan) {
+            fail(client, "Firmware does not fit in flash memory: %s.",
+                    stmGetErrorMessage(session));
+            goto Done;
+        }
+    }
+
+    if(job->diff) {
+        /* The cached plan covers every page of the image; narrow down a
+         * copy to the pages that differ on this board. */
+        pages = malloc(stmDevicePageCount(stmGetDevice(session)));
+        if(!pages) abort();
+        plan = pages;
+        if(!stmDiffPages(session, image->buffer, pages)) {
+            fail(client, "Unable to read flash: %s.",
+                    stmGetErrorMessage(session));
+            goto Done;
+        }
+    }
+
+    if(job->erase) {
+        if(!stmEraseAll(session)) {
+            fail(client, "Unable to erase flash: %s.",
+                    stmGetErrorMessage(session));
+            goto Done;
+        }
+    } else if(image) {
+        if(!stmErase(session, plan)) {
+            fail(client, "Unable to erase flash: %s.",
+                    stmGetErrorMessage(session));
+            goto Done;
+        }
+    }
+
+    if(image) {
+        if(!stmWrite(session, image->buffer, job->diff ? plan : NULL)) {
+            fail(client, "Unable to write flash: %s.",
+                    stmGetErrorMessage(session));
+            goto Done;
+        }
+        if(job->verify && !stmVerify(session, image->buffer)) {
+            fail(client, "Flash verification failed: %s.",
+                    stmGetErrorMessage(session));
+            goto Done;
+        }
+    }
+
+    if(job->run) {
+        reply(client->fd, "progress job=%lu step=starting percent=0\n",
+                job->id);
+        if(!stmRun(session, stmGetFlashBegin(session))) {
+            fail(client, "Unable to start firmware: %s.",
+                    stmGetErrorMessage(session));
+            goto Done;
+        }
+    }
+
+    success = true;
+
+Done:
+    if(!success) {
+        stmSerialClose(port->dev);
+        port->dev = NULL;
+    }
+    if(image) releaseImage(image);
+    free(pages);
+    *stats = *stmGetStats(session);
+    stmDestroySession(session);
+    return success;
+}
+
+static Port *queuePort(const char *name, unsigned long *ticket) {
+    pthread_mutex_lock(&portLock);
+
+    Port *port = ports;
+    while(port && strcmp(port->name, name)) port = port->next;
+    if(!port) {
+        port = calloc(1, sizeof(Port));
+        if(!port) abort();
+        port->name = strdup(name);
+        if(!port->name) abort();
+        pthread_cond_init(&port->turn, NULL);
+        port->next = ports;
+        ports = port;
+    }
+    *ticket = port->nextTicket++;
+
+    pthread_mutex_unlock(&portLock);
+    return port;
+}
+
+static void waitTurn(Port *port, unsigned long ticket) {
+    pthread_mutex_lock(&portLock);
+    while(port->serving != ticket) {
+        pthread_cond_wait(&port->turn, &portLock);
+    }
+    pthread_mutex_unlock(&portLock);
+}
+
+static void releasePort(Port *port) {
+    pthread_mutex_lock(&portLock);
+    port->serving++;
+    pthread_cond_broadcast(&port->turn);
+    pthread_mutex_unlock(&portLock);
+}
+
+static Image *acquireImage(const char *fileName, uint32_t flashBegin,
+        uint16_t deviceId, bool *cached) {
+    FirmwareId id;
+    if(!stmIdentifyFirmware(fileName, &id)) return NULL;
+
+    pthread_mutex_lock(&cacheLock);
+    Image *image = images;
+    while(image && !(image->id.size == id.size
+            && !memcmp(image->id.digest, id.digest, sizeof(id.digest))
+            && (image->format != FIRMWARE_RAW || image->base == flashBegin))) {
+        image = image->next;
+    }
+    if(image) {
+        image->users++;
+        *cached = true;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    if(image) return image;
+
+    /* Load outside the lock, so that jobs using cached images need not
+     * wait.  Two jobs missing the same image both load it; the copies are
+     * equivalent and the spare one is evicted eventually. */
+    image = loadImage(fileName, &id, flashBegin, deviceId);
+    if(!image) return NULL;
+    *cached = image->stored != NULL;
+
+    pthread_mutex_lock(&cacheLock);
+    image->next = images;
+    images = image;
+    numImages++;
+    evictImages();
+    pthread_mutex_unlock(&cacheLock);
+    return image;
+}
+
+/** \brief Load an image from the on-disk cache, or parse it. */
+static Image *loadImage(const char *fileName, const FirmwareId *id,
+        uint32_t flashBegin, uint16_t deviceId) {
+    Image *image = calloc(1, sizeof(Image));
+    if(!image) abort();
+    image->id = *id;
+    image->users = 1;
+
+    if(diskCache) image->stored = ImageCache_load(diskCache, id, deviceId);
+    if(image->stored) {
+        image->format = CachedImage_format(image->stored);
+        image->buffer = CachedImage_buffer(image->stored);
+        image->storedId = deviceId;
+    } else {
+        /* Images outlive the job, so they must not depend on the file.
+         * Keep them under the identity of what was actually parsed. */
+        image->format = FIRMWARE_AUTO;
+        image->parsed = stmReadFirmware(fileName, &image->format,
+                FIRMWARE_COPY, &image->id);
+        if(!image->parsed) {
+            free(image);
+            return NULL;
+        }
+        if(image->format == FIRMWARE_RAW) {
+            SparseBuffer_offset(image->parsed, flashBegin);
+        }
+        image->buffer = image->parsed;
+    }
+    image->base = image->format == FIRMWARE_RAW ? flashBegin : 0;
+    return image;
+}
+
+static void releaseImage(Image *image) {
+    pthread_mutex_lock(&cacheLock);
+    image->users--;
+    image->lastUsed = stmSerialClock();
+    evictImages();
+    pthread_mutex_unlock(&cacheLock);
+}
+
+static const uint8_t *planImage(Image *image, StmSession *session) {
+    const DeviceInfo *device = stmGetDevice(session);
+
+    bool store = false;
+
+    pthread_mutex_lock(&cacheLock);
+    PagePlan *plan = image->plans;
+    while(plan && plan->device != device) plan = plan->next;
+    if(!plan) {
+        uint8_t *pages = stmMapPages(session, image->buffer);
+        if(pages) {
+            store = diskCache
+                    && !(image->stored && image->storedId == device->id);
+            plan = malloc(sizeof(PagePlan));
+            if(!plan) abort();
+            plan->device = device;
+            plan->pages = pages;
+            plan->next = image->plans;
+            image->plans = plan;
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+
+    /* The image and its plans stay put while the job uses them. */
+    if(store && !ImageCache_store(diskCache, &image->id, device->id,
+            image->format, image->buffer, plan->pages,
+            stmDevicePageCount(device))) {
+        printf("Not cached: %s\n", stmLastErrorMessage());
+        fflush(stdout);
+    }
+    return plan ? plan->pages : NULL;
+}
+
+/* Called with cacheLock held. */
+static void evictImages(void) {
+    while(numImages > MAX_CACHED_IMAGES) {
+        Image **oldest = NULL;
+        for(Image **image = &images; *image; image = &(*image)->next) {
+            if((*image)->users) continue;
+            if(!oldest || (*image)->lastUsed < (*oldest)->lastUsed) {
+                oldest = image;
+            }
+        }
+        if(!oldest) return;
+
+        Image *victim = *oldest;
+        *oldest = victim->next;
+        numImages--;
+        while(victim->plans) {
+            PagePlan *plan = victim->plans;
+            victim->plans = plan->next;
+            free(plan->pages);
+            free(plan);
+        }
+        if(victim->stored) CachedImage_destroy(victim->stored);
+        if(victim->parsed) SparseBuffer_destroy(victim->parsed);
+        free(victim);
+    }
+}
+
+static void reply(int fd, const char *format, ...) {
+    char message[MAX_REQUEST];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if(length < 0) return;
+    if((size_t)length >= sizeof(message)) length = sizeof(message) - 1;
+
+    /* A client that has gone away does not stop its job. */
+    const char *data = message;
+    while(length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) return;
+        data += n;
+        length -= n;
+    }
+}
+
+static void fail(Client *client, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(client->error, sizeof(client->error), format, args);
+    va_end(args);
+}
+
+static void showProgress(StmSession *session, StmStep step, int percent) {
+    Client *client = stmGetUser(session);
+    if(percent == STM_STEP_DONE) return;
+    reply(client->fd, "progress job=%lu step=%s percent=%d\n",
+            client->job->id, STEP_NAMES[step], percent);
+}
@@ -0,0 +1,83 @@
+/* Checks stmReadFirmware() against the files in tests/data.
+ *
+ * Build with the sanitizers (make check does), so that reads and writes
+ * beyond the parsers' buffers fail the test. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../firmware.h"
+
+/** An expected result of parsing a file. */
+typedef struct {
+    const char *fileName;
+    FirmwareFormat format;
+    /** Whether the file is valid. */
+    bool valid;
+    /** The number of bytes and contiguous blocks of a valid file. */
+    size_t size;
+    size_t blocks;
+} Case;
+
+static const Case CASES[] = {
+    { "gap.hex", FIRMWARE_AUTO, true, 40, 2 },
+    { "gap.hex", FIRMWARE_RAW, true, 144, 1 },
+    { "segments.elf", FIRMWARE_AUTO, true, 24, 2 },
+    { "oversized-record.hex", FIRMWARE_AUTO, false, 0, 0 },
+    { "oversized-record.srec", FIRMWARE_AUTO, false, 0, 0 }
+};
+
+static const FirmwareStorage STORAGES[] = { FIRMWARE_MAP, FIRMWARE_COPY };
+
+static bool runCase(const char *dataDir, const Case *test,
+        FirmwareStorage storage);
+
+int main(int argc, char **argv) {
+    const char *dataDir = argc > 1 ? argv[1] : "tests/data";
+    int failures = 0;
+    size_t runs = 0;
+
+    for(size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); ++i) {
+        for(size_t j = 0; j < sizeof(STORAGES) / sizeof(STORAGES[0]); ++j) {
+            if(!runCase(dataDir, &CASES[i], STORAGES[j])) failures++;
+            runs++;
+        }
+    }
+
+    printf("firmware-test: %d of %zu cases failed\n", failures, runs);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static bool runCase(const char *dataDir, const Case *test,
+        FirmwareStorage storage) {
+    char fileName[256];
+    snprintf(fileName, sizeof(fileName), "%s/%s", dataDir, test->fileName);
+
+    FirmwareFormat format = test->format;
+    FirmwareId id;
+    SparseBuffer *buffer = stmReadFirmware(fileName, &format, storage, &id);
+    bool ok = (buffer != NULL) == test->valid;
+    if(!buffer && ok) ok = stmLastError() == STM_ERROR_FORMAT;
+    if(buffer && ok) {
+        size_t blocks = 0;
+        SparseBuffer_rewind(buffer);
+        while(SparseBuffer_read(buffer, 0).data) blocks++;
+        ok = SparseBuffer_size(buffer) == test->size
+                && blocks == test->blocks;
+
+        /* The parsed data is identified like the file. */
+        FirmwareId fileId;
+        ok = ok && stmIdentifyFirmware(fileName, &fileId)
+                && fileId.size == id.size
+                && !memcmp(fileId.digest, id.digest, sizeof(id.digest));
+    }
+    if(buffer) SparseBuffer_destroy(buffer);
+
+    if(!ok) {
+        fprintf(stderr, "FAIL: %s (%s)\n", fileName,
+                storage == FIRMWARE_MAP ? "mapped" : "copied");
+    }
+    return ok;
+}
@@ -0,0 +1,215 @@
+/* Times parsing Intel HEX files into a SparseBuffer and reading them back.
+ *
+ * Without arguments, synthetic files of 16-byte records are generated: one
+ * after another, with a gap after each record, and with gaps in random
+ * order.  The benchmark only uses the SparseBuffer functions that every
+ * implementation so far has had, so that make bench-baseline can build it
+ * against an older sparse-buffer.c for comparison.  Each file is timed in a
+ * child process, so that a crash, such as the skip list's on contiguous
+ * records, only loses its own row.
+ *
+ * The Makefile links the benchmark with malloc(), calloc() and realloc()
+ * wrapped, so that each parse also reports the allocations it made.
+ *
+ * Usage: hex-bench [FILE...]
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../firmware.h"
+
+#define RECORD_SIZE 16
+/** Each file is timed this often, and the fastest run counts. */
+#define REPEATS 20
+/** The image is read back this often per run, as programming and verifying
+ * do. */
+#define PASSES 10
+
+typedef enum {
+    ASCENDING,
+    GAPS,
+    SHUFFLED
+} Layout;
+
+typedef struct {
+    const char *name;
+    Layout layout;
+    size_t records;
+} Synthetic;
+
+static const Synthetic SYNTHETICS[] = {
+    { "10k ascending", ASCENDING, 10000 },
+    { "10k with gaps", GAPS, 10000 },
+    { "10k shuffled", SHUFFLED, 10000 },
+    { "100k ascending", ASCENDING, 100000 },
+    { "100k with gaps", GAPS, 100000 }
+};
+
+/** Allocations made since the counter was last cleared. */
+static size_t allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static bool writeHex(const char *fileName, const Synthetic *synthetic);
+static bool timeFile(const char *name, const char *fileName);
+static bool timeFileChild(const char *name, const char *fileName);
+static double now(void);
+
+int main(int argc, char **argv) {
+    bool ok = true;
+    printf("Best of %d parses and %d passes of 256-byte reads\n", REPEATS,
+            PASSES);
+
+    for(int i = 1; ok && i < argc; ++i) ok = timeFile(argv[i], argv[i]);
+    if(argc > 1) return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    char fileName[] = "/tmp/hex-bench-XXXXXX";
+    int fd = mkstemp(fileName);
+    if(fd == -1) return EXIT_FAILURE;
+    close(fd);
+    for(size_t i = 0; ok && i < sizeof(SYNTHETICS) / sizeof(SYNTHETICS[0]);
+            ++i) {
+        ok = writeHex(fileName, &SYNTHETICS[i])
+                && timeFile(SYNTHETICS[i].name, fileName);
+    }
+    unlink(fileName);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+static bool writeHex(const char *fileName, const Synthetic *synthetic) {
+    FILE *file = fopen(fileName, "w");
+    if(!file) return false;
+
+    size_t records = synthetic->records;
+    size_t *order = malloc(records * sizeof(size_t));
+    if(!order) abort();
+    for(size_t i = 0; i < records; ++i) order[i] = i;
+    if(synthetic->layout == SHUFFLED) {
+        srand(42);
+        for(size_t i = records - 1; i > 0; --i) {
+            size_t j = rand() % (i + 1);
+            size_t tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+    }
+
+    size_t stride = synthetic->layout == ASCENDING ? RECORD_SIZE
+            : 2 * RECORD_SIZE;
+    unsigned long segment = ~0UL;
+    for(size_t i = 0; i < records; ++i) {
+        unsigned long addr = 0x08000000UL + order[i] * stride;
+        if(addr >> 16 != segment) {
+            segment = addr >> 16;
+            uint8_t sum = 2 + 4 + (segment >> 8) + segment;
+            fprintf(file, ":02000004%04lX%02X\n", segment,
+                    (uint8_t)-sum);
+        }
+        uint8_t sum = RECORD_SIZE + (uint8_t)(addr >> 8) + (uint8_t)addr;
+        fprintf(file, ":%02X%04lX00", RECORD_SIZE, addr & 0xFFFF);
+        for(size_t j = 0; j < RECORD_SIZE; ++j) {
+            uint8_t data = (uint8_t)(order[i] * 31 + j);
+            sum += data;
+            fprintf(file, "%02X", data);
+        }
+        fprintf(file, "%02X\n", (uint8_t)-sum);
+    }
+    fprintf(file, ":00000001FF\n");
+
+    free(order);
+    return fclose(file) == 0;
+}
+
+static bool timeFile(const char *name, const char *fileName) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == -1) return false;
+    if(pid == 0) {
+        bool ok = timeFileChild(name, fileName);
+        fflush(stdout);
+        _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int status;
+    if(waitpid(pid, &status, 0) == -1) return false;
+    if(WIFSIGNALED(status)) {
+        printf("  %-22s crashed with signal %d\n", name, WTERMSIG(status));
+        return true;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool timeFileChild(const char *name, const char *fileName) {
+    double bestParse = 0;
+    double bestRead = 0;
+    size_t blocks = 0;
+    size_t parseAllocations = 0;
+
+    for(int repeat = 0; repeat < REPEATS; ++repeat) {
+        allocations = 0;
+        double start = now();
+        FirmwareFormat format = FIRMWARE_AUTO;
+        SparseBuffer *buffer = stmReadFirmware(fileName, &format,
+                FIRMWARE_COPY, NULL);
+        parseAllocations = allocations;
+        if(!buffer) {
+            fprintf(stderr, "Unable to read \"%s\".\n", fileName);
+            return false;
+        }
+        double parsed = now();
+
+        unsigned sum = 0;
+        blocks = 0;
+        for(int pass = 0; pass < PASSES; ++pass) {
+            SparseBufferCursor cursor;
+            MemBlock block;
+            SparseBuffer_begin(buffer, &cursor);
+            while((block = SparseBuffer_next(buffer, &cursor, 256)).data) {
+                sum += block.data[0];
+                blocks++;
+            }
+        }
+        double read = now();
+        SparseBuffer_destroy(buffer);
+        /* Keep the reads from being optimized away. */
+        if(sum == 1) putchar('\0');
+
+        if(repeat == 0 || parsed - start < bestParse) {
+            bestParse = parsed - start;
+        }
+        if(repeat == 0 || read - parsed < bestRead) bestRead = read - parsed;
+    }
+
+    printf("  %-16s parse %8.2f ms %7zu allocs  read %6.2f ms %6zu blocks\n",
+            name, bestParse, parseAllocations, bestRead, blocks / PASSES);
+    return true;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
@@ -0,0 +1,77 @@
+/* Checks Sha256 against the test vectors of FIPS 180-4, fed in pieces of
+ * several sizes so that partial blocks are carried over. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../sha256.h"
+
+/** A message and its digest in hexadecimal. */
+typedef struct {
+    const char *message;
+    /** How often the message is repeated. */
+    size_t repeat;
+    const char *digest;
+} Case;
+
+static const Case CASES[] = {
+    { "", 1,
+      "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { "abc", 1,
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+    { "a", 1000000,
+      "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" }
+};
+
+static bool runCase(const Case *test, size_t piece);
+
+int main(void) {
+    static const size_t PIECES[] = { 1, 7, 64, 1000 };
+    int failures = 0;
+    int runs = 0;
+
+    for(size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); ++i) {
+        for(size_t j = 0; j < sizeof(PIECES) / sizeof(PIECES[0]); ++j) {
+            if(!runCase(&CASES[i], PIECES[j])) failures++;
+            runs++;
+        }
+    }
+
+    printf("sha256-test: %d of %d cases failed\n", failures, runs);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static bool runCase(const Case *test, size_t piece) {
+    size_t length = strlen(test->message);
+    size_t total = length * test->repeat;
+    char *message = malloc(total + 1);
+    if(!message) abort();
+    for(size_t i = 0; i < test->repeat; ++i) {
+        memcpy(message + i * length, test->message, length);
+    }
+
+    Sha256 sha;
+    Sha256_init(&sha);
+    for(size_t offset = 0; offset < total; offset += piece) {
+        size_t n = total - offset < piece ? total - offset : piece;
+        Sha256_update(&sha, message + offset, n);
+    }
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    Sha256_final(&sha, digest);
+    free(message);
+
+    char hex[2 * SHA256_DIGEST_SIZE + 1];
+    for(size_t i = 0; i < SHA256_DIGEST_SIZE; ++i) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+    bool ok = !strcmp(hex, test->digest);
+    if(!ok) {
+        fprintf(stderr, "FAIL: \"%.16s\" x %zu in pieces of %zu\n",
+                test->message, test->repeat, piece);
+    }
+    return ok;
+}
@@ -0,0 +1,113 @@
+/* Times SparseBuffer_set() on the insert patterns of firmware parsers.
+ *
+ * Parsers mostly append records in ascending order, with or without gaps
+ * between them.  Shuffled records and blocks spanning many extents stress
+ * the search and the merge.
+ *
+ * Usage: sparse-buffer-bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../sparse-buffer.h"
+
+#define RECORDS 100000
+#define RECORD_SIZE 16
+/** Each pattern is timed this often, and the fastest run counts. */
+#define REPEATS 10
+
+typedef enum {
+    /** Records one after another. */
+    ASCENDING,
+    /** Records with a record-sized gap after each. */
+    GAPS,
+    /** Records with gaps in random order. */
+    SHUFFLED,
+    /** Records with gaps, then blocks that each cover 64 of them. */
+    SPANNING
+} Pattern;
+
+typedef struct {
+    const char *name;
+    Pattern pattern;
+    /** Out of order inserts move the extents after them, so they take time
+     * in proportion to the number of extents and get fewer records. */
+    size_t records;
+} Run;
+
+static const Run RUNS[] = {
+    { "ascending", ASCENDING, RECORDS },
+    { "ascending with gaps", GAPS, RECORDS },
+    { "shuffled with gaps", SHUFFLED, RECORDS / 10 },
+    { "spanning 64 extents", SPANNING, RECORDS }
+};
+
+static double timeRun(const Run *run, const uint8_t *data, size_t *extents);
+static double now(void);
+
+int main(void) {
+    static uint8_t data[64 * 2 * RECORD_SIZE];
+    for(size_t i = 0; i < sizeof(data); ++i) data[i] = (uint8_t)(i * 31 + 7);
+
+    printf("Inserting records of %d bytes\n", RECORD_SIZE);
+    for(size_t i = 0; i < sizeof(RUNS) / sizeof(RUNS[0]); ++i) {
+        size_t extents;
+        double ms = timeRun(&RUNS[i], data, &extents);
+        printf("  %-22s %6zu records %8.2f ms  %7.1f ns/record"
+                "  %6zu extents\n", RUNS[i].name, RUNS[i].records, ms,
+                ms * 1e6 / RUNS[i].records, extents);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static double timeRun(const Run *run, const uint8_t *data, size_t *extents) {
+    size_t *order = malloc(run->records * sizeof(size_t));
+    if(!order) abort();
+    for(size_t i = 0; i < run->records; ++i) order[i] = i;
+    if(run->pattern == SHUFFLED) {
+        srand(42);
+        for(size_t i = run->records - 1; i > 0; --i) {
+            size_t j = rand() % (i + 1);
+            size_t tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+    }
+
+    double best = 0;
+    for(int repeat = 0; repeat < REPEATS; ++repeat) {
+        double start = now();
+        SparseBuffer *buffer = SparseBuffer_create();
+        for(size_t i = 0; i < run->records; ++i) {
+            size_t stride = run->pattern == ASCENDING ? 1 : 2;
+            MemBlock block = { order[i] * stride * RECORD_SIZE, RECORD_SIZE,
+                    data };
+            SparseBuffer_set(buffer, block);
+        }
+        if(run->pattern == SPANNING) {
+            size_t span = 64 * 2 * RECORD_SIZE;
+            for(size_t offset = 0; offset < 2 * run->records * RECORD_SIZE;
+                    offset += span) {
+                MemBlock block = { offset, span - RECORD_SIZE, data };
+                SparseBuffer_set(buffer, block);
+            }
+        }
+        *extents = SparseBuffer_extentCount(buffer);
+        SparseBuffer_destroy(buffer);
+
+        double ms = now() - start;
+        if(repeat == 0 || ms < best) best = ms;
+    }
+
+    free(order);
+    return best;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
@@ -0,0 +1,175 @@
+/* Checks SparseBuffer against a flat reference array.
+ *
+ * Each round sets and borrows random blocks, which overlap, adjoin and span
+ * any number of existing extents, and mirrors every write in a plain array.
+ * The buffer must then hold exactly the bytes written last, as maximal
+ * contiguous extents, whichever way it is read.  The blocks come from a
+ * fixed seed, so that failures can be reproduced. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../sparse-buffer.h"
+
+/** The address range the blocks fall in. */
+#define SPACE 4096
+#define SEED 42
+#define ROUNDS 20000
+#define MAX_WRITES 60
+#define MAX_LENGTH 200
+/** Borrowed data must stay put until the buffer is destroyed. */
+#define MAX_SOURCES MAX_WRITES
+
+/** The bytes written so far, and which of them were. */
+typedef struct {
+    uint8_t data[SPACE];
+    bool set[SPACE];
+} Reference;
+
+static void writeRandom(SparseBuffer *buffer, Reference *ref,
+        uint8_t *source);
+static bool checkBlocks(const SparseBuffer *buffer, const Reference *ref);
+static bool checkStats(const SparseBuffer *buffer, const Reference *ref);
+static bool checkAligned(const SparseBuffer *buffer, const Reference *ref);
+
+int main(void) {
+    srand(SEED);
+
+    static uint8_t sources[MAX_SOURCES][MAX_LENGTH];
+    for(int round = 0; round < ROUNDS; ++round) {
+        Reference ref;
+        memset(&ref, 0, sizeof(ref));
+        SparseBuffer *buffer = SparseBuffer_create();
+
+        int writes = rand() % MAX_WRITES + 1;
+        for(int i = 0; i < writes; ++i) {
+            writeRandom(buffer, &ref, sources[i]);
+        }
+
+        bool ok = checkBlocks(buffer, &ref) && checkStats(buffer, &ref)
+                && checkAligned(buffer, &ref);
+        SparseBuffer_destroy(buffer);
+        if(!ok) {
+            fprintf(stderr, "FAIL: round %d\n", round);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("sparse-buffer-test: %d rounds passed\n", ROUNDS);
+    return EXIT_SUCCESS;
+}
+
+static void writeRandom(SparseBuffer *buffer, Reference *ref,
+        uint8_t *source) {
+    MemBlock block;
+    if(rand() % 3 == 0) {
+        /* Blocks on a grid adjoin each other often. */
+        block.offset = rand() % (SPACE / 64) * 64;
+        block.length = 64;
+    } else {
+        block.offset = rand() % (SPACE - MAX_LENGTH);
+        block.length = rand() % MAX_LENGTH + 1;
+    }
+    for(size_t i = 0; i < block.length; ++i) source[i] = rand();
+    block.data = source;
+
+    if(rand() % 2) {
+        SparseBuffer_borrow(buffer, block);
+    } else {
+        SparseBuffer_set(buffer, block);
+    }
+    memcpy(ref->data + block.offset, source, block.length);
+    memset(ref->set + block.offset, true, block.length);
+}
+
+/** Reads the buffer in whole extents, and in pieces of at most 7 bytes. */
+static bool checkBlocks(const SparseBuffer *buffer, const Reference *ref) {
+    static const size_t LENGTHS[] = { 0, 7 };
+
+    for(size_t i = 0; i < sizeof(LENGTHS) / sizeof(LENGTHS[0]); ++i) {
+        bool seen[SPACE] = { false };
+        size_t end = 0;
+        SparseBufferCursor cursor;
+        MemBlock block;
+        SparseBuffer_begin(buffer, &cursor);
+        while((block = SparseBuffer_next(buffer, &cursor, LENGTHS[i])).data) {
+            if(block.offset < end || block.offset + block.length > SPACE) {
+                return false;
+            }
+            /* Whole extents are maximal, so never adjoin. */
+            if(LENGTHS[i] == 0 && end && block.offset == end) return false;
+            for(size_t j = 0; j < block.length; ++j) {
+                size_t offset = block.offset + j;
+                if(!ref->set[offset] || block.data[j] != ref->data[offset]) {
+                    return false;
+                }
+                seen[offset] = true;
+            }
+            end = block.offset + block.length;
+        }
+        if(memcmp(seen, ref->set, sizeof(seen))) return false;
+    }
+    return true;
+}
+
+static bool checkStats(const SparseBuffer *buffer, const Reference *ref) {
+    size_t size = 0;
+    size_t runs = 0;
+    size_t begin = 0;
+    size_t end = 0;
+    for(size_t i = 0; i < SPACE; ++i) {
+        if(!ref->set[i]) continue;
+        if(size++ == 0) begin = i;
+        if(i == 0 || !ref->set[i - 1]) runs++;
+        end = i + 1;
+    }
+
+    size_t bufferBegin;
+    size_t bufferEnd;
+    bool bounded = SparseBuffer_bounds(buffer, &bufferBegin, &bufferEnd);
+    return SparseBuffer_size(buffer) == size
+            && SparseBuffer_extentCount(buffer) == runs
+            && bounded == (size > 0)
+            && (!bounded || (bufferBegin == begin && bufferEnd == end));
+}
+
+/** Reads the buffer in aligned windows, as the programming steps do. */
+static bool checkAligned(const SparseBuffer *buffer, const Reference *ref) {
+    static const size_t SIZES[] = { 16, 32, 256 };
+    static const uint8_t FILL = 0xA5;
+    size_t size = SIZES[rand() % 3];
+    size_t granule = rand() % 2 ? 4 : 1;
+
+    uint8_t scratch[256];
+    bool seen[SPACE] = { false };
+    size_t end = 0;
+    SparseBufferCursor cursor;
+    MemBlock block;
+    size_t dataLength;
+    SparseBuffer_begin(buffer, &cursor);
+    while((block = SparseBuffer_nextAligned(buffer, &cursor, size, granule,
+            FILL, scratch, &dataLength)).data) {
+        if(block.length == 0 || block.offset < end
+                || block.offset % granule || block.length % granule
+                || block.offset / size
+                        != (block.offset + block.length - 1) / size) {
+            return false;
+        }
+        size_t count = 0;
+        for(size_t i = 0; i < block.length; ++i) {
+            size_t offset = block.offset + i;
+            if(offset < SPACE && ref->set[offset]) {
+                if(block.data[i] != ref->data[offset]) return false;
+                seen[offset] = true;
+                count++;
+            } else if(block.data[i] != FILL) {
+                return false;
+            }
+        }
+        if(count != dataLength) return false;
+        end = block.offset + block.length;
+    }
+    return memcmp(seen, ref->set, sizeof(seen)) == 0;
+}
@@ -0,0 +1,164 @@
+/* Times stm32sprog writing an image to stm32sim.
+ *
+ * Each run writes the same image to a fresh simulator.  The first run has
+ * stm32sprog pause 80 ms after every block, as it did before it paced
+ * itself on the bootloader's ACKs; the second relies on the ACKs alone; the
+ * third has every FAIL_EVERY-th block rejected, which must not slow down the
+ * blocks after it; the last keeps several transactions in flight, which the
+ * simulator allows.  Responses reach stm32sprog TURNAROUND us late, as
+ * through a USB-serial adapter.
+ *
+ * Usage: write-bench [SIZE_KB] [WRITE_LATENCY_US]
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROGRAM "./stm32sprog"
+#define SIMULATOR "./stm32sim"
+/** The fixed pause after each block that ACK pacing replaced. */
+#define FIXED_WRITE_DELAY "80000"
+#define FAIL_EVERY "50"
+#define TURNAROUND "1000"
+/** Time to wait for the simulator to create its pty, in milliseconds. */
+#define SIM_START_TIMEOUT 2000
+
+typedef struct {
+    const char *name;
+    /** The minimum write gap passed with -g, or NULL. */
+    const char *writeGap;
+    /** The simulator's -f argument, or NULL. */
+    const char *failEvery;
+    /** The pipeline depth passed with -P, or NULL. */
+    const char *pipelineDepth;
+} Run;
+
+static const Run RUNS[] = {
+    { "fixed 80 ms sleep per block", FIXED_WRITE_DELAY, NULL, NULL },
+    { "paced on ACKs", NULL, NULL, NULL },
+    { "paced, 1 in " FAIL_EVERY " rejected", NULL, FAIL_EVERY, NULL },
+    { "pipelined 8 deep", NULL, NULL, "8" }
+};
+
+static bool timeRun(const char *imageName, const char *writeLatency,
+        const Run *run, double *seconds);
+static pid_t startSimulator(const char *linkName, const char *writeLatency,
+        const char *failEvery);
+static pid_t startProgram(const char *linkName, const char *imageName,
+        const Run *run);
+static double now(void);
+
+int main(int argc, char **argv) {
+    size_t sizeKb = argc > 1 ? strtoul(argv[1], NULL, 0) : 32;
+    const char *writeLatency = argc > 2 ? argv[2] : "5000";
+
+    char imageName[] = "/tmp/write-bench-XXXXXX";
+    int fd = mkstemp(imageName);
+    if(fd == -1) return EXIT_FAILURE;
+    bool ok = true;
+    for(size_t i = 0; ok && i < sizeKb * 1024; ++i) {
+        uint8_t data = (uint8_t)(i * 31 + 7);
+        ok = write(fd, &data, 1) == 1;
+    }
+    close(fd);
+
+    printf("Writing %zu KB, %s us per block\n", sizeKb, writeLatency);
+    for(size_t i = 0; ok && i < sizeof(RUNS) / sizeof(RUNS[0]); ++i) {
+        double seconds;
+        ok = timeRun(imageName, writeLatency, &RUNS[i], &seconds);
+        if(ok) {
+            printf("  %-30s %7.2f s  %7.1f KB/s\n", RUNS[i].name, seconds,
+                    sizeKb / seconds);
+        }
+    }
+
+    unlink(imageName);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static bool timeRun(const char *imageName, const char *writeLatency,
+        const Run *run, double *seconds) {
+    char linkName[64];
+    snprintf(linkName, sizeof(linkName), "/tmp/write-bench-%d.tty",
+            (int)getpid());
+    pid_t sim = startSimulator(linkName, writeLatency, run->failEvery);
+    if(sim == -1) return false;
+
+    bool ok = false;
+    double start = now();
+    pid_t pid = startProgram(linkName, imageName, run);
+    int status;
+    if(pid != -1 && waitpid(pid, &status, 0) == pid) {
+        ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    *seconds = now() - start;
+    if(!ok) fprintf(stderr, "%s: programming failed.\n", run->name);
+
+    kill(sim, SIGTERM);
+    waitpid(sim, NULL, 0);
+    return ok;
+}
+
+/** \brief Start stm32sim and wait for its pty to appear at linkName. */
+static pid_t startSimulator(const char *linkName, const char *writeLatency,
+        const char *failEvery) {
+    (void)unlink(linkName);
+    pid_t pid = fork();
+    if(pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        const char *args[] = { SIMULATOR, "-l", linkName, "-W", writeLatency,
+                "-t", TURNAROUND, "-f", failEvery, NULL };
+        if(!failEvery) args[7] = NULL;
+        execv(SIMULATOR, (char **)args);
+        _exit(127);
+    }
+
+    for(int waited = 0; pid != -1 && access(linkName, F_OK) == -1;
+            waited += 10) {
+        if(waited >= SIM_START_TIMEOUT || waitpid(pid, NULL, WNOHANG)) {
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+            fprintf(stderr, "Unable to start %s.\n", SIMULATOR);
+            return -1;
+        }
+        usleep(10000);
+    }
+    return pid;
+}
+
+/** \brief Start stm32sprog writing imageName, with its progress hidden. */
+static pid_t startProgram(const char *linkName, const char *imageName,
+        const Run *run) {
+    pid_t pid = fork();
+    if(pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        const char *args[9] = { PROGRAM, "-d", linkName, "-w", imageName };
+        size_t argCount = 5;
+        if(run->writeGap) {
+            args[argCount++] = "-g";
+            args[argCount++] = run->writeGap;
+        }
+        if(run->pipelineDepth) {
+            args[argCount++] = "-P";
+            args[argCount++] = run->pipelineDepth;
+        }
+        execv(PROGRAM, (char **)args);
+        _exit(127);
+    }
+    return pid;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}